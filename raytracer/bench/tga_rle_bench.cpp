@@ -0,0 +1,275 @@
+/////////////////////////////////////////////////////////////////
+//
+// Benchmark for the TGA RLE codec: writes and reads back a frame
+// with
+//
+//   stream   - the codec as it was: a packet at a time through
+//              std::ofstream, a pixel at a time from std::ifstream
+//   TGAImage - tgaimage.cpp: blocks of rows encoded in parallel and
+//              written at once, decoded from memory
+//
+// and checks both decoders give back the frame from both files, and
+// that an image read from a file (mapped, if uncompressed) can be
+// changed and written back over that file.
+//
+// Build it on its own, e.g.
+//   g++ -O2 -pthread -I../src tga_rle_bench.cpp ../src/tgaimage.cpp -o tga_rle_bench
+//   cl /O2 /EHsc /I..\src tga_rle_bench.cpp ..\src\tgaimage.cpp
+//
+// and run it as tga_rle_bench [width height] 2>nul, as read_tga_file
+// reports every image it reads on stderr.
+//
+/////////////////////////////////////////////////////////////////
+
+#include <chrono>
+#include <fstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "tgaimage.h"
+
+const int Repeats = 5;
+
+// The stream encoder TGAImage::unload_rle_data used to be
+bool StreamUnloadRle(const unsigned char* data, int width, int height, int bytespp, std::ofstream& out)
+{
+	const unsigned char max_chunk_length = 128;
+	unsigned long npixels = width * height;
+	unsigned long curpix = 0;
+	while (curpix < npixels) {
+		unsigned long chunkstart = curpix * bytespp;
+		unsigned long curbyte = curpix * bytespp;
+		unsigned char run_length = 1;
+		bool raw = true;
+		while (curpix + run_length < npixels && run_length < max_chunk_length) {
+			bool succ_eq = true;
+			for (int t = 0; succ_eq && t < bytespp; t++) {
+				succ_eq = (data[curbyte + t] == data[curbyte + t + bytespp]);
+			}
+			curbyte += bytespp;
+			if (1 == run_length) {
+				raw = !succ_eq;
+			}
+			if (raw && succ_eq) {
+				run_length--;
+				break;
+			}
+			if (!raw && !succ_eq) {
+				break;
+			}
+			run_length++;
+		}
+		curpix += run_length;
+		out.put(raw ? run_length - 1 : run_length + 127);
+		if (!out.good()) {
+			return false;
+		}
+		out.write((char*)(data + chunkstart), (raw ? run_length * bytespp : bytespp));
+		if (!out.good()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// And the stream decoder TGAImage::load_rle_data used to be
+bool StreamLoadRle(unsigned char* data, int width, int height, int bytespp, std::ifstream& in)
+{
+	unsigned long pixelcount = width * height;
+	unsigned long currentpixel = 0;
+	unsigned long currentbyte = 0;
+	TGAColor colorbuffer;
+	do {
+		unsigned char chunkheader = 0;
+		chunkheader = in.get();
+		if (!in.good()) {
+			return false;
+		}
+		if (chunkheader < 128) {
+			chunkheader++;
+			for (int i = 0; i < chunkheader; i++) {
+				in.read((char*)colorbuffer.bgra, bytespp);
+				if (!in.good()) {
+					return false;
+				}
+				for (int t = 0; t < bytespp; t++)
+					data[currentbyte++] = colorbuffer.bgra[t];
+				currentpixel++;
+				if (currentpixel > pixelcount) {
+					return false;
+				}
+			}
+		}
+		else {
+			chunkheader -= 127;
+			in.read((char*)colorbuffer.bgra, bytespp);
+			if (!in.good()) {
+				return false;
+			}
+			for (int i = 0; i < chunkheader; i++) {
+				for (int t = 0; t < bytespp; t++)
+					data[currentbyte++] = colorbuffer.bgra[t];
+				currentpixel++;
+				if (currentpixel > pixelcount) {
+					return false;
+				}
+			}
+		}
+	} while (currentpixel < pixelcount);
+	return true;
+}
+
+// Header, packets and footer as TGAImage::write_tga_file writes them
+bool StreamWrite(TGAImage& image, const char* filename)
+{
+	std::ofstream out(filename, std::ios::binary);
+	TGA_Header header;
+	memset((void*)&header, 0, sizeof(header));
+	header.bitsperpixel = image.get_bytespp() << 3;
+	header.width = image.get_width();
+	header.height = image.get_height();
+	header.datatypecode = 10;
+	header.imagedescriptor = 0x20;
+	out.write((char*)&header, sizeof(header));
+	if (!StreamUnloadRle(image.buffer(), image.get_width(), image.get_height(), image.get_bytespp(), out))
+	{
+		return false;
+	}
+
+	unsigned char footer[26] = { 0, 0, 0, 0, 0, 0, 0, 0, 'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0' };
+	out.write((char*)footer, sizeof(footer));
+	return out.good();
+}
+
+// Only for the files written here: RLE, top-left origin
+bool StreamRead(TGAImage& image, const char* filename)
+{
+	std::ifstream in(filename, std::ios::binary);
+	TGA_Header header;
+	in.read((char*)&header, sizeof(header));
+	if (!in.good() || header.datatypecode != 10)
+	{
+		return false;
+	}
+
+	image = TGAImage(header.width, header.height, header.bitsperpixel >> 3);
+	return StreamLoadRle(image.buffer(), image.get_width(), image.get_height(), image.get_bytespp(), in);
+}
+
+// Something like a render: a banded sky gradient (runs), noisy spheres (raw packets) and flat ground
+TGAImage MakeFrame(int width, int height)
+{
+	TGAImage image(width, height, TGAImage::RGBA);
+	srand(1);
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			float u = float(x) / width - 0.5f, v = float(y) / height - 0.5f;
+			TGAColor c;
+			if (v > 0.3f)
+			{
+				c = TGAColor(60, 80, 40, 255);
+			}
+			else if (u * u * 3.f + v * v < 0.1f)
+			{
+				int noise = rand() % 24;
+				c = TGAColor(180 + noise, 150 + noise, 60 + noise / 2, 255);
+			}
+			else
+			{
+				int band = int((v + 0.5f) * 96.f);
+				c = TGAColor(128 + band, 178 + band / 2, 255, 255);
+			}
+			image.set(x, y, c);
+		}
+	}
+	return image;
+}
+
+bool SamePixels(TGAImage& a, TGAImage& b)
+{
+	return a.get_width() == b.get_width() && a.get_height() == b.get_height() && a.get_bytespp() == b.get_bytespp() &&
+		memcmp(a.buffer(), b.buffer(), size_t(a.get_width()) * a.get_height() * a.get_bytespp()) == 0;
+}
+
+long FileSize(const char* filename)
+{
+	std::ifstream in(filename, std::ios::binary | std::ios::ate);
+	return long(in.tellg());
+}
+
+// Reads filename, changes a pixel and writes it back over the file; true if it reads back the same
+bool WriteInPlace(TGAImage& frame, const char* filename, bool readRle, bool writeRle)
+{
+	frame.write_tga_file(filename, readRle);
+	TGAImage image;
+	if (!image.read_tga_file(filename))
+	{
+		return false;
+	}
+
+	image.set(0, 0, TGAColor(1, 2, 3, 4));
+	if (!image.write_tga_file(filename, writeRle))
+	{
+		return false;
+	}
+
+	TGAImage reread;
+	return reread.read_tga_file(filename) && SamePixels(reread, image);
+}
+
+// Best of Repeats, in milliseconds
+template <class F>
+double Time(F f)
+{
+	double best = 1e30;
+	for (int r = 0; r < Repeats; r++)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		f();
+		best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	}
+	return best;
+}
+
+int main(int argc, char** argv)
+{
+	int width = argc >= 3 ? atoi(argv[1]) : 3840;
+	int height = argc >= 3 ? atoi(argv[2]) : 2160;
+	TGAImage frame = MakeFrame(width, height);
+	const char* streamFile = "tga_rle_bench_stream.tga";
+	const char* imageFile = "tga_rle_bench_image.tga";
+
+	double streamWrite = Time([&] { StreamWrite(frame, streamFile); });
+	double imageWrite = Time([&] { frame.write_tga_file(imageFile); });
+
+	TGAImage streamFromStream, streamFromImage, imageFromStream, imageFromImage;
+	double streamRead = Time([&] { StreamRead(streamFromStream, streamFile); });
+	double imageRead = Time([&] { imageFromImage.read_tga_file(imageFile); });
+	StreamRead(streamFromImage, imageFile);
+	imageFromStream.read_tga_file(streamFile);
+
+	bool matches = SamePixels(streamFromStream, frame) && SamePixels(streamFromImage, frame) &&
+		SamePixels(imageFromStream, frame) && SamePixels(imageFromImage, frame);
+
+	printf("%d x %d, %ld bytes (stream), %ld bytes (TGAImage)\n", width, height, FileSize(streamFile), FileSize(imageFile));
+	printf("write  stream %8.2f ms  TGAImage %8.2f ms  %5.2fx\n", streamWrite, imageWrite, streamWrite / imageWrite);
+	printf("read   stream %8.2f ms  TGAImage %8.2f ms  %5.2fx\n", streamRead, imageRead, streamRead / imageRead);
+	printf("%s\n", matches ? "pixels match" : "MISMATCH");
+
+	bool inPlace = true;
+	for (int from = 0; from < 2; from++)
+	{
+		for (int to = 0; to < 2; to++)
+		{
+			inPlace = WriteInPlace(frame, imageFile, from == 1, to == 1) && inPlace;
+		}
+	}
+	printf("%s\n", inPlace ? "written back in place" : "IN PLACE WRITE FAILED");
+
+	remove(streamFile);
+	remove(imageFile);
+	return matches && inPlace ? 0 : 1;
+}
@@ -0,0 +1,221 @@
+/////////////////////////////////////////////////////////////////
+//
+// Micro-benchmark for the vector math: the same two kernels (a
+// reflection + sky shade and a ray / sphere distance) run with
+//
+//   PlainVector3 - Vector3 as it was: three floats, scalar code
+//   Vector3      - the SSE backed one from vector3.h
+//   Vector3x4    - 4 rays per call
+//   Vector3x8    - 8 rays per call (two SSE halves without AVX)
+//
+// and checks they all give bit identical results.
+//
+// Build it on its own, e.g.
+//   g++ -O2 -msse4.1 -I../src vector3_bench.cpp -o vector3_bench
+//   g++ -O2 -mavx2 -I../src vector3_bench.cpp -o vector3_bench
+//   cl /O2 /EHsc /arch:AVX2 /I..\src vector3_bench.cpp
+//
+/////////////////////////////////////////////////////////////////
+
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "vector3.h"
+#include "vector3_wide.h"
+
+// The scalar class Vector3 replaced, with lerp added so it can run the same kernels
+class PlainVector3
+{
+public:
+
+	float x, y, z;
+
+	PlainVector3() {}
+	PlainVector3(const PlainVector3& v) : x(v.x), y(v.y), z(v.z) {}
+	PlainVector3(float nx, float ny, float nz) : x(nx), y(ny), z(nz) {}
+	PlainVector3(float f) : x(f), y(f), z(f) {}
+
+	PlainVector3 &operator =(const PlainVector3 &v) {
+		x = v.x; y = v.y; z = v.z;
+		return *this;
+	}
+
+	void normalize()
+	{
+		float magSqrd = dot(*this);
+		if (magSqrd > 0.0f)
+		{
+			float oneOverMag = 1.f / sqrtf(magSqrd);
+			x *= oneOverMag;
+			y *= oneOverMag;
+			z *= oneOverMag;
+		}
+	}
+
+	PlainVector3 normalized() const
+	{
+		PlainVector3 v(*this);
+		v.normalize();
+		return v;
+	}
+
+	float dot(const PlainVector3& v) const
+	{
+		return x * v.x + y * v.y + z * v.z;
+	}
+
+	inline PlainVector3 reflect(const PlainVector3& v) const
+	{
+		return *this - (v * 2.f * v.dot(*this));
+	}
+
+	static inline PlainVector3 lerp(const PlainVector3& a, const PlainVector3& b, float t)
+	{
+		return a * (1.f - t) + b * t;
+	}
+
+	inline PlainVector3 operator +(const PlainVector3& v) const { return PlainVector3(v.x + x, v.y + y, v.z + z); }
+	inline PlainVector3 operator -(const PlainVector3& v) const { return PlainVector3(x - v.x, y - v.y, z - v.z); }
+	inline PlainVector3 operator *(float s) const { return PlainVector3(x * s, y * s, z * s); }
+	inline PlainVector3 operator *(const PlainVector3& v) const { return PlainVector3(v.x * this->x, v.y * this->y, v.z * this->z); }
+
+	~PlainVector3() {}
+};
+
+// So the kernels can be written once for float and for Float4 / Float8
+inline float select(bool mask, float a, float b) { return mask ? a : b; }
+
+const int NumRays = 1 << 14;
+const int Repeats = 200;
+
+// Reflects the ray about the normal and shades the reflection with a sky gradient
+template <class V, class F>
+inline V shade(const V& dir, const V& normal, const V& albedo)
+{
+	V reflected = dir.normalized().reflect(normal);
+	F t = F(0.5f) * (reflected.y + F(1.f));
+	return albedo * V::lerp(V(1.f, 1.f, 1.f), V(0.5f, 0.7f, 1.f), t);
+}
+
+// Distance to a sphere of radius 0.5 at the origin, or -1 for a miss
+template <class V, class F>
+inline F sphereDistance(const V& origin, const V& dir)
+{
+	F a = dir.dot(dir);
+	F b = F(2.f) * origin.dot(dir);
+	F c = origin.dot(origin) - F(0.25f);
+	F discriminant = b * b - F(4.f) * a * c;
+	F t = (-b - sqrt(select(discriminant > F(0.f), discriminant, F(0.f)))) / (F(2.f) * a);
+	return select(discriminant > F(0.f), t, F(-1.f));
+}
+
+struct Inputs
+{
+	std::vector<float> x[3], y[3], z[3];	// direction, normal / origin, albedo
+};
+
+struct Outputs
+{
+	std::vector<float> x, y, z, t;
+
+	Outputs() : x(NumRays), y(NumRays), z(NumRays), t(NumRays) {}
+
+	bool operator ==(const Outputs& o) const
+	{
+		size_t bytes = NumRays * sizeof(float);
+		return memcmp(&x[0], &o.x[0], bytes) == 0 && memcmp(&y[0], &o.y[0], bytes) == 0 &&
+			memcmp(&z[0], &o.z[0], bytes) == 0 && memcmp(&t[0], &o.t[0], bytes) == 0;
+	}
+};
+
+// One ray at a time, from array of structures data as the renderer keeps it
+template <class V>
+double runScalar(const Inputs& in, Outputs& out)
+{
+	std::vector<V> dirs(NumRays), others(NumRays), albedos(NumRays);
+	for (int i = 0; i < NumRays; i++)
+	{
+		dirs[i] = V(in.x[0][i], in.y[0][i], in.z[0][i]);
+		others[i] = V(in.x[1][i], in.y[1][i], in.z[1][i]);
+		albedos[i] = V(in.x[2][i], in.y[2][i], in.z[2][i]);
+	}
+
+	std::vector<V> colors(NumRays);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int r = 0; r < Repeats; r++)
+	{
+		for (int i = 0; i < NumRays; i++)
+		{
+			colors[i] = shade<V, float>(dirs[i], others[i], albedos[i]);
+			out.t[i] = sphereDistance<V, float>(others[i], dirs[i]);
+		}
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	for (int i = 0; i < NumRays; i++)
+	{
+		out.x[i] = colors[i].x;
+		out.y[i] = colors[i].y;
+		out.z[i] = colors[i].z;
+	}
+	return seconds;
+}
+
+// Width rays at a time, straight from the structure of arrays data
+template <class V, class F>
+double runWide(const Inputs& in, Outputs& out)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int r = 0; r < Repeats; r++)
+	{
+		for (int i = 0; i < NumRays; i += V::Width)
+		{
+			V dir = V::load(&in.x[0][i], &in.y[0][i], &in.z[0][i]);
+			V other = V::load(&in.x[1][i], &in.y[1][i], &in.z[1][i]);
+			V albedo = V::load(&in.x[2][i], &in.y[2][i], &in.z[2][i]);
+			shade<V, F>(dir, other, albedo).store(&out.x[i], &out.y[i], &out.z[i]);
+			sphereDistance<V, F>(other, dir).store(&out.t[i]);
+		}
+	}
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void report(const char* name, double seconds, double baseline, bool matches)
+{
+	double nsPerRay = seconds * 1e9 / (double(NumRays) * Repeats);
+	printf("%-14s %7.2f ns/ray  %5.2fx  %s\n", name, nsPerRay, baseline / seconds, matches ? "" : "MISMATCH");
+}
+
+int main(int argc, char** argv)
+{
+	Inputs in;
+	srand(1);
+	for (int k = 0; k < 3; k++)
+	{
+		in.x[k].resize(NumRays);
+		in.y[k].resize(NumRays);
+		in.z[k].resize(NumRays);
+		for (int i = 0; i < NumRays; i++)
+		{
+			in.x[k][i] = float(rand()) / RAND_MAX * 2.f - 1.f;
+			in.y[k][i] = float(rand()) / RAND_MAX * 2.f - 1.f;
+			in.z[k][i] = float(rand()) / RAND_MAX * 2.f - 1.f;
+		}
+	}
+
+	Outputs plain, sse, x4, x8;
+	double plainTime = runScalar<PlainVector3>(in, plain);
+	double sseTime = runScalar<Vector3>(in, sse);
+	double x4Time = runWide<Vector3x4, Float4>(in, x4);
+	double x8Time = runWide<Vector3x8, Float8>(in, x8);
+
+	report("PlainVector3", plainTime, plainTime, true);
+	report("Vector3", sseTime, plainTime, sse == plain);
+	report("Vector3x4", x4Time, plainTime, x4 == plain);
+	report("Vector3x8", x8Time, plainTime, x8 == plain);
+
+	return sse == plain && x4 == plain && x8 == plain ? 0 : 1;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "vector3.h"
+#include <float.h>
+#include <math.h>
+
+/////////////////////////////////////////////////////////////////
+//
+// class AABB - axis aligned bounding box used by the BVH
+//
+/////////////////////////////////////////////////////////////////
+
+class AABB
+{
+public:
+
+	Vector3 pMin;
+	Vector3 pMax;
+
+	// Default box is empty (inverted), so growing it by anything gives that thing
+	AABB() : pMin(FLT_MAX), pMax(-FLT_MAX) {}
+
+	AABB(const Vector3& a, const Vector3& b) : pMin(a), pMax(b) {}
+
+	inline void grow(const Vector3& p)
+	{
+		pMin = Vector3(fminf(pMin.x, p.x), fminf(pMin.y, p.y), fminf(pMin.z, p.z));
+		pMax = Vector3(fmaxf(pMax.x, p.x), fmaxf(pMax.y, p.y), fmaxf(pMax.z, p.z));
+	}
+
+	inline void grow(const AABB& b)
+	{
+		grow(b.pMin);
+		grow(b.pMax);
+	}
+
+	inline bool isEmpty() const
+	{
+		return pMin.x > pMax.x || pMin.y > pMax.y || pMin.z > pMax.z;
+	}
+
+	inline Vector3 centroid() const
+	{
+		return (pMin + pMax) * 0.5f;
+	}
+
+	inline float surfaceArea() const
+	{
+		if (isEmpty())
+		{
+			return 0.f;
+		}
+
+		Vector3 e = pMax - pMin;
+		return 2.f * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+
+	// Returns the axis the box is widest along
+	inline int longestAxis() const
+	{
+		Vector3 e = pMax - pMin;
+		return (e.x > e.y && e.x > e.z) ? 0 : (e.y > e.z ? 1 : 2);
+	}
+
+	// Slab test. invDir is 1 / ray direction, precomputed once per ray by the caller.
+	inline bool hit(const Vector3& origin, const Vector3& invDir, float tMin, float tMax) const
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float t0 = (pMin[axis] - origin[axis]) * invDir[axis];
+			float t1 = (pMax[axis] - origin[axis]) * invDir[axis];
+			if (invDir[axis] < 0.f)
+			{
+				float tmp = t0; t0 = t1; t1 = tmp;
+			}
+
+			tMin = t0 > tMin ? t0 : tMin;
+			tMax = t1 < tMax ? t1 : tMax;
+			if (tMax < tMin)
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+};
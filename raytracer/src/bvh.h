@@ -0,0 +1,465 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include "surface.h"
+#include "aabb.h"
+
+/////////////////////////////////////////////////////////////////
+//
+// class BVH - bounding volume hierarchy over a list of surfaces,
+// built top-down with a binned surface area heuristic (SAH).
+//
+// Nodes are stored flattened in one array; the two children of an
+// interior node are always next to each other, so only the index of
+// the left child is stored. Like SurfaceGroup, the BVH doesn't own
+// the surfaces it is built over.
+//
+/////////////////////////////////////////////////////////////////
+
+struct BVHNode
+{
+	AABB box;
+	int leftOrFirst;	// interior: index of left child (right is +1), leaf: first primitive
+	int count;			// number of primitives, 0 for interior nodes
+	int axis;			// split axis, used to visit the nearer child first
+};
+
+class BVH : public Surface {
+public:
+	BVH() {}
+	BVH(Surface **l, int n) { build(l, n); }
+
+	void build(Surface **l, int n);
+
+	virtual bool intersect(const Ray& r, float tMin, float tMax, SurfaceHit& hit) const;
+	virtual bool boundingBox(AABB& box) const;
+	virtual void hitPacket(const RayPacket& packet, float tMin, float* tMax, hit_record* recs, bool* hits) const;
+
+public:
+
+	static const int NumBins = 12;
+	static const int MaxLeafSize = 4;
+	static const int MaxDepth = 64;
+
+	std::vector<BVHNode> nodes;
+	std::vector<Surface*> primitives;
+
+private:
+
+	struct BuildPrimitive
+	{
+		AABB box;
+		Vector3 centroid;
+		Surface* surface;
+	};
+
+	void subdivide(int nodeIndex, std::vector<BuildPrimitive>& prims, int depth);
+	float findBestSplit(int first, int count, const std::vector<BuildPrimitive>& prims, const AABB& centroidBounds, int& axisOut, float& splitOut) const;
+
+	void traversePacket(const RayPacket& packet, float tMin, float* tMax, SurfaceHit* closest, bool* hits) const;
+
+	// Surfaces that can't be bounded are tested on every ray
+	std::vector<Surface*> unbounded;
+};
+
+void BVH::build(Surface **l, int n)
+{
+	nodes.clear();
+	primitives.clear();
+	unbounded.clear();
+
+	std::vector<BuildPrimitive> prims;
+	prims.reserve(n);
+	for (int i = 0; i < n; i++)
+	{
+		BuildPrimitive p;
+		if (l[i]->boundingBox(p.box))
+		{
+			p.centroid = p.box.centroid();
+			p.surface = l[i];
+			prims.push_back(p);
+		}
+		else
+		{
+			unbounded.push_back(l[i]);
+		}
+	}
+
+	if (prims.empty())
+	{
+		return;
+	}
+
+	// A binary tree with at most one primitive per leaf has fewer than 2n nodes
+	nodes.reserve(2 * prims.size());
+
+	BVHNode root;
+	root.leftOrFirst = 0;
+	root.count = int(prims.size());
+	root.axis = 0;
+	for (size_t i = 0; i < prims.size(); i++)
+	{
+		root.box.grow(prims[i].box);
+	}
+	nodes.push_back(root);
+
+	subdivide(0, prims, 0);
+
+	primitives.reserve(prims.size());
+	for (size_t i = 0; i < prims.size(); i++)
+	{
+		primitives.push_back(prims[i].surface);
+	}
+}
+
+// Evaluates the SAH at NumBins - 1 planes along each axis and returns the cheapest,
+// expressed as (area weighted primitive count) so it can be compared with the leaf cost.
+float BVH::findBestSplit(int first, int count, const std::vector<BuildPrimitive>& prims, const AABB& centroidBounds, int& axisOut, float& splitOut) const
+{
+	float bestCost = FLT_MAX;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float boundsMin = centroidBounds.pMin[axis];
+		float boundsMax = centroidBounds.pMax[axis];
+		if (boundsMin == boundsMax)
+		{
+			continue;
+		}
+
+		AABB binBoxes[NumBins];
+		int binCounts[NumBins] = { 0 };
+		float scale = float(NumBins) / (boundsMax - boundsMin);
+		for (int i = first; i < first + count; i++)
+		{
+			int bin = int((prims[i].centroid[axis] - boundsMin) * scale);
+			bin = bin < NumBins - 1 ? bin : NumBins - 1;
+			binCounts[bin]++;
+			binBoxes[bin].grow(prims[i].box);
+		}
+
+		// Sweep from both ends to get the area and count left and right of each plane
+		float leftArea[NumBins - 1], rightArea[NumBins - 1];
+		int leftCount[NumBins - 1], rightCount[NumBins - 1];
+		AABB leftBox, rightBox;
+		int leftSum = 0, rightSum = 0;
+		for (int i = 0; i < NumBins - 1; i++)
+		{
+			leftSum += binCounts[i];
+			leftCount[i] = leftSum;
+			leftBox.grow(binBoxes[i]);
+			leftArea[i] = leftBox.surfaceArea();
+
+			rightSum += binCounts[NumBins - 1 - i];
+			rightCount[NumBins - 2 - i] = rightSum;
+			rightBox.grow(binBoxes[NumBins - 1 - i]);
+			rightArea[NumBins - 2 - i] = rightBox.surfaceArea();
+		}
+
+		float binWidth = (boundsMax - boundsMin) / float(NumBins);
+		for (int i = 0; i < NumBins - 1; i++)
+		{
+			if (leftCount[i] == 0 || rightCount[i] == 0)
+			{
+				continue;
+			}
+
+			float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				axisOut = axis;
+				splitOut = boundsMin + binWidth * (i + 1);
+			}
+		}
+	}
+
+	return bestCost;
+}
+
+void BVH::subdivide(int nodeIndex, std::vector<BuildPrimitive>& prims, int depth)
+{
+	// Copy out what we need, nodes may be reallocated as children are added
+	int first = nodes[nodeIndex].leftOrFirst;
+	int count = nodes[nodeIndex].count;
+	float nodeArea = nodes[nodeIndex].box.surfaceArea();
+
+	if (count <= 1 || depth >= MaxDepth)
+	{
+		return;
+	}
+
+	AABB centroidBounds;
+	for (int i = first; i < first + count; i++)
+	{
+		centroidBounds.grow(prims[i].centroid);
+	}
+
+	int axis = 0;
+	float split = 0.f;
+	int mid = first;
+	float bestCost = findBestSplit(first, count, prims, centroidBounds, axis, split);
+	if (bestCost < FLT_MAX)
+	{
+		// Traversal and intersection costs are both taken as 1, so splitting is only worth
+		// it when the expected number of tests beats testing everything in this node.
+		float splitCost = 1.f + bestCost / nodeArea;
+		if (splitCost >= float(count) && count <= MaxLeafSize)
+		{
+			return;
+		}
+
+		int i = first;
+		int j = first + count - 1;
+		while (i <= j)
+		{
+			if (prims[i].centroid[axis] < split)
+			{
+				i++;
+			}
+			else
+			{
+				std::swap(prims[i], prims[j--]);
+			}
+		}
+		mid = i;
+	}
+
+	if (mid == first || mid == first + count)
+	{
+		// All centroids coincide, so there's no plane to split on; fall back to halving by count
+		if (count <= MaxLeafSize)
+		{
+			return;
+		}
+
+		axis = centroidBounds.longestAxis();
+		mid = first + count / 2;
+		std::nth_element(prims.begin() + first, prims.begin() + mid, prims.begin() + first + count,
+			[axis](const BuildPrimitive& a, const BuildPrimitive& b) { return a.centroid[axis] < b.centroid[axis]; });
+	}
+
+	BVHNode left, right;
+	left.leftOrFirst = first;
+	left.count = mid - first;
+	left.axis = 0;
+	for (int i = first; i < mid; i++)
+	{
+		left.box.grow(prims[i].box);
+	}
+	right.leftOrFirst = mid;
+	right.count = first + count - mid;
+	right.axis = 0;
+	for (int i = mid; i < first + count; i++)
+	{
+		right.box.grow(prims[i].box);
+	}
+
+	int leftIndex = int(nodes.size());
+	nodes.push_back(left);
+	nodes.push_back(right);
+
+	nodes[nodeIndex].leftOrFirst = leftIndex;
+	nodes[nodeIndex].count = 0;
+	nodes[nodeIndex].axis = axis;
+
+	subdivide(leftIndex, prims, depth + 1);
+	subdivide(leftIndex + 1, prims, depth + 1);
+}
+
+bool BVH::intersect(const Ray& r, float tMin, float tMax, SurfaceHit& hit) const
+{
+	bool hitAny = false;
+	float closestSoFar = tMax;
+
+	for (size_t i = 0; i < unbounded.size(); i++)
+	{
+		if (unbounded[i]->intersect(r, tMin, closestSoFar, hit)) {
+			hitAny = true;
+			closestSoFar = hit.t;
+		}
+	}
+
+	if (nodes.empty())
+	{
+		return hitAny;
+	}
+
+	const Vector3& origin = r.origin();
+	Vector3 invDir = 1.f / r.direction();
+
+	int stack[MaxDepth + 1];
+	int stackSize = 0;
+	int nodeIndex = 0;
+
+	while (true)
+	{
+		const BVHNode& node = nodes[nodeIndex];
+		if (node.box.hit(origin, invDir, tMin, closestSoFar))
+		{
+			if (node.count > 0)
+			{
+				for (int i = node.leftOrFirst; i < node.leftOrFirst + node.count; i++)
+				{
+					if (primitives[i]->intersect(r, tMin, closestSoFar, hit)) {
+						hitAny = true;
+						closestSoFar = hit.t;
+					}
+				}
+			}
+			else
+			{
+				// Visit the child on the near side of the split first, so closestSoFar
+				// shrinks early and the far child's box test is more likely to fail
+				if (invDir[node.axis] < 0.f)
+				{
+					stack[stackSize++] = node.leftOrFirst;
+					nodeIndex = node.leftOrFirst + 1;
+				}
+				else
+				{
+					stack[stackSize++] = node.leftOrFirst + 1;
+					nodeIndex = node.leftOrFirst;
+				}
+				continue;
+			}
+		}
+
+		if (stackSize == 0)
+		{
+			break;
+		}
+		nodeIndex = stack[--stackSize];
+	}
+
+	return hitAny;
+}
+
+bool BVH::boundingBox(AABB& box) const
+{
+	box = AABB();
+	for (size_t i = 0; i < unbounded.size(); i++)
+	{
+		AABB childBox;
+		if (!unbounded[i]->boundingBox(childBox))
+		{
+			return false;
+		}
+		box.grow(childBox);
+	}
+
+	if (!nodes.empty())
+	{
+		box.grow(nodes[0].box);
+	}
+
+	return !box.isEmpty();
+}
+
+// The packet walks the tree together. A node is skipped when it's outside the packet's frustum, and
+// otherwise the walk only carries on from the first ray that hits its box: the rays before that one
+// miss it, so they miss everything below it too.
+void BVH::hitPacket(const RayPacket& packet, float tMin, float* tMax, hit_record* recs, bool* hits) const
+{
+	SurfaceHit closest[RayPacket::MaxRays];
+	for (size_t u = 0; u < unbounded.size(); u++)
+	{
+		for (int i = 0; i < packet.count; i++)
+		{
+			if (unbounded[u]->intersect(Ray(packet.origin, packet.direction(i)), tMin, tMax[i], closest[i])) {
+				hits[i] = true;
+				tMax[i] = closest[i].t;
+			}
+		}
+	}
+
+	if (!nodes.empty())
+	{
+		traversePacket(packet, tMin, tMax, closest, hits);
+	}
+
+	for (int i = 0; i < packet.count; i++)
+	{
+		if (hits[i])
+		{
+			closest[i].surface->fillHit(Ray(packet.origin, packet.direction(i)), closest[i], recs[i]);
+		}
+	}
+}
+
+void BVH::traversePacket(const RayPacket& packet, float tMin, float* tMax, SurfaceHit* closest, bool* hits) const
+{
+	if (packet.count == 0)
+	{
+		return;
+	}
+
+	Vector3 invDir[RayPacket::MaxRays];
+	for (int i = 0; i < packet.count; i++)
+	{
+		invDir[i] = 1.f / packet.direction(i);
+	}
+
+	struct StackEntry
+	{
+		int node;
+		int firstActive;
+	};
+
+	StackEntry stack[MaxDepth + 1];
+	int stackSize = 0;
+	int nodeIndex = 0;
+	int firstActive = 0;
+
+	while (true)
+	{
+		const BVHNode& node = nodes[nodeIndex];
+		if (!packet.frustum.outside(node.box))
+		{
+			while (firstActive < packet.count && !node.box.hit(packet.origin, invDir[firstActive], tMin, tMax[firstActive]))
+			{
+				firstActive++;
+			}
+		}
+		else
+		{
+			firstActive = packet.count;
+		}
+
+		if (firstActive < packet.count)
+		{
+			if (node.count > 0)
+			{
+				for (int p = node.leftOrFirst; p < node.leftOrFirst + node.count; p++)
+				{
+					for (int i = firstActive; i < packet.count; i++)
+					{
+						if (primitives[p]->intersect(Ray(packet.origin, packet.direction(i)), tMin, tMax[i], closest[i])) {
+							hits[i] = true;
+							tMax[i] = closest[i].t;
+						}
+					}
+				}
+			}
+			else
+			{
+				// Near child first, going by the first active ray
+				int nearChild = invDir[firstActive][node.axis] < 0.f ? node.leftOrFirst + 1 : node.leftOrFirst;
+				int farChild = nearChild == node.leftOrFirst ? node.leftOrFirst + 1 : node.leftOrFirst;
+				StackEntry entry = { farChild, firstActive };
+				stack[stackSize++] = entry;
+				nodeIndex = nearChild;
+				continue;
+			}
+		}
+
+		if (stackSize == 0)
+		{
+			break;
+		}
+		stackSize--;
+		nodeIndex = stack[stackSize].node;
+		firstActive = stack[stackSize].firstActive;
+	}
+}
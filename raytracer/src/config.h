@@ -0,0 +1,44 @@
+#pragma once
+
+#include "vector3.h"
+#include "sampler.h"
+
+/////////////////////////////////////////////////////////////////
+//
+// struct Config - camera and render settings, shared by the
+// renderers in main.cpp and wavefront.h
+//
+/////////////////////////////////////////////////////////////////
+
+struct Config
+{
+	int nx, ny, ns;
+	Vector3 lowerLeft;
+	Vector3 horizontal;
+	Vector3 vertical;
+	Vector3 origin;
+	unsigned int seed;
+	int threads;		// 0 = one per core
+	SamplerType sampler;
+
+	// Paths end after maxDepth bounces. From rrStartDepth on, Russian roulette
+	// ends them earlier the less they can still contribute.
+	int maxDepth;
+	int rrStartDepth;
+
+	// Adaptive sampling, on when noiseTarget > 0: passes of up to ns samples keep going over
+	// the pixels whose estimated error is above noiseTarget (in displayed units, 1 = full
+	// scale) until none are left or the film holds sampleBudget samples (<= 0 = no limit)
+	float noiseTarget;
+	long long sampleBudget;
+
+	// Trace with the wavefront engine (wavefront.h) instead of one path at a time
+	bool wavefront;
+
+	// Otherwise, trace camera rays in packets of 8x8 pixels (ray_packet.h)
+	bool packets;
+
+	// When the camera moves, the progressive preview keeps what it can of the old view's
+	// samples (temporal.h), counting them as at most this many per pixel. 0 starts over.
+	int temporalHistory;
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+/////////////////////////////////////////////////////////////////
+//
+// Which vector instruction sets the CPU running us has, from CPUID.
+//
+// An instruction set only counts if the OS also saves its
+// registers on a context switch (XGETBV), otherwise AVX code
+// would fault even on a CPU that has it.
+//
+// The RT_SIMD environment variable (sse4, avx2 or avx512) caps
+// the level, to compare kernels on one machine. It never raises
+// it past what the CPU supports.
+//
+/////////////////////////////////////////////////////////////////
+
+enum class SimdLevel
+{
+	SSE4,
+	AVX2,
+	AVX512
+};
+
+namespace CpuFeatures
+{
+	inline void cpuid(int leaf, int subleaf, unsigned int regs[4])
+	{
+#if defined(_MSC_VER)
+		__cpuidex((int*)regs, leaf, subleaf);
+#else
+		__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+	}
+
+	// Register state the OS saves (XCR0)
+	inline unsigned long long enabledState()
+	{
+#if defined(_MSC_VER)
+		return _xgetbv(0);
+#else
+		unsigned int eax, edx;
+		__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+		return ((unsigned long long)edx << 32) | eax;
+#endif
+	}
+
+	inline SimdLevel supported()
+	{
+		unsigned int regs[4];
+		cpuid(0, 0, regs);
+		int maxLeaf = int(regs[0]);
+
+		cpuid(1, 0, regs);
+		bool osxsave = (regs[2] & (1u << 27)) != 0;
+		bool avx = (regs[2] & (1u << 28)) != 0;
+		if (!osxsave || !avx || maxLeaf < 7)
+		{
+			return SimdLevel::SSE4;
+		}
+
+		unsigned long long state = enabledState();
+		bool ymm = (state & 0x6) == 0x6;			// SSE and AVX state
+		bool zmm = (state & 0xe6) == 0xe6;			// and the AVX-512 opmask and upper registers
+
+		cpuid(7, 0, regs);
+		bool avx2 = (regs[1] & (1u << 5)) != 0;
+		bool avx512f = (regs[1] & (1u << 16)) != 0;
+
+		if (avx512f && zmm)
+		{
+			return SimdLevel::AVX512;
+		}
+		if (avx2 && ymm)
+		{
+			return SimdLevel::AVX2;
+		}
+		return SimdLevel::SSE4;
+	}
+
+	inline const char* name(SimdLevel level)
+	{
+		switch (level)
+		{
+		case SimdLevel::AVX512: return "AVX-512";
+		case SimdLevel::AVX2: return "AVX2";
+		default: return "SSE4";
+		}
+	}
+
+	// What the CPU supports, lowered to RT_SIMD if that is set
+	inline SimdLevel select()
+	{
+		SimdLevel level = supported();
+		const char* cap = getenv("RT_SIMD");
+		if (cap != NULL)
+		{
+			SimdLevel wanted = strcmp(cap, "avx512") == 0 ? SimdLevel::AVX512 : (strcmp(cap, "avx2") == 0 ? SimdLevel::AVX2 : SimdLevel::SSE4);
+			if (wanted < level)
+			{
+				level = wanted;
+			}
+		}
+
+		return level;
+	}
+};
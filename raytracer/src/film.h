@@ -0,0 +1,173 @@
+#pragma once
+
+#include <algorithm>
+#include <math.h>
+#include <vector>
+#include "vector3.h"
+
+/////////////////////////////////////////////////////////////////
+//
+// class Film - float accumulation buffer.
+//
+// Keeps the running sum of radiance and the number of samples taken
+// for every pixel, so samples from successive passes add up and the
+// image only needs clearing when what it shows changes. The sum of
+// squared luminance is kept too, which gives a per-pixel variance
+// estimate for adaptive sampling.
+//
+// Radiance is linear and unbounded (HDR). The channels are kept in
+// separate planes so that the resolve to displayable pixels
+// (resolve.h) can take 4 or 8 pixels at a time.
+//
+// A film can also hold just a band of the rows of a larger image,
+// for rendering straight to a file (image_stream.h). Its pixels are
+// still addressed by their row in the whole image.
+//
+/////////////////////////////////////////////////////////////////
+
+class Film
+{
+public:
+
+	Film() : filmWidth(0), filmHeight(0), filmFirstRow(0) {}
+
+	Film(int width, int height) : filmWidth(0), filmHeight(0), filmFirstRow(0) { resize(width, height); }
+
+	// Also clears. The film then holds rows firstRow to firstRow + height - 1.
+	void resize(int width, int height, int firstRow = 0)
+	{
+		filmWidth = width;
+		filmHeight = height;
+		filmFirstRow = firstRow;
+		red.assign(width * height, 0.f);
+		green.assign(width * height, 0.f);
+		blue.assign(width * height, 0.f);
+		luminanceSquares.assign(width * height, 0.f);
+		counts.assign(width * height, 0);
+	}
+
+	void clear()
+	{
+		std::fill(red.begin(), red.end(), 0.f);
+		std::fill(green.begin(), green.end(), 0.f);
+		std::fill(blue.begin(), blue.end(), 0.f);
+		std::fill(luminanceSquares.begin(), luminanceSquares.end(), 0.f);
+		std::fill(counts.begin(), counts.end(), 0);
+	}
+
+	inline void addSample(int x, int y, const Vector3& radiance)
+	{
+		int i = index(x, y);
+		float l = luminance(radiance);
+		red[i] += radiance.x;
+		green[i] += radiance.y;
+		blue[i] += radiance.z;
+		luminanceSquares[i] += l * l;
+		counts[i]++;
+	}
+
+	// Makes radiance the pixel's only sample, for renderers that finish a pixel at once
+	inline void set(int x, int y, const Vector3& radiance)
+	{
+		int i = index(x, y);
+		float l = luminance(radiance);
+		red[i] = radiance.x;
+		green[i] = radiance.y;
+		blue[i] = radiance.z;
+		luminanceSquares[i] = l * l;
+		counts[i] = 1;
+	}
+
+	// Starts pixel (x, y) off with the samples pixel (fromX, fromY) of another film holds, weighted
+	// down to count as at most maxSamples so that new samples can still move the average
+	inline void reuse(const Film& from, int fromX, int fromY, int x, int y, int maxSamples)
+	{
+		int i = index(x, y);
+		int j = from.index(fromX, fromY);
+		int n = from.counts[j];
+		float scale = n > maxSamples ? float(maxSamples) / float(n) : 1.f;
+		red[i] = from.red[j] * scale;
+		green[i] = from.green[j] * scale;
+		blue[i] = from.blue[j] * scale;
+		luminanceSquares[i] = from.luminanceSquares[j] * scale;
+		counts[i] = std::min(n, maxSamples);
+	}
+
+	inline int samples(int x, int y) const
+	{
+		return counts[index(x, y)];
+	}
+
+	// Mean radiance so far, black if there are no samples yet
+	inline Vector3 average(int x, int y) const
+	{
+		int i = index(x, y);
+		return counts[i] > 0 ? sum(i) / float(counts[i]) : Vector3(0.f);
+	}
+
+	// Standard error of the mean luminance, from the sample variance. Needs 2 samples.
+	inline float standardError(int x, int y) const
+	{
+		int i = index(x, y);
+		int n = counts[i];
+		if (n < 2)
+		{
+			return INFINITY;
+		}
+
+		float mean = luminance(sum(i)) / float(n);
+		float variance = (luminanceSquares[i] / float(n) - mean * mean) * float(n) / float(n - 1);
+		return sqrtf(fmaxf(variance, 0.f) / float(n));
+	}
+
+	long long totalSamples() const
+	{
+		long long total = 0;
+		for (size_t i = 0; i < counts.size(); i++)
+		{
+			total += counts[i];
+		}
+		return total;
+	}
+
+	int maxSamples() const
+	{
+		return counts.empty() ? 0 : *std::max_element(counts.begin(), counts.end());
+	}
+
+	static inline float luminance(const Vector3& c)
+	{
+		return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+	}
+
+	inline int width() const { return filmWidth; }
+	inline int height() const { return filmHeight; }
+	inline int firstRow() const { return filmFirstRow; }
+
+	// Row y of each plane, for the resolve
+	inline const float* redRow(int y) const { return &red[index(0, y)]; }
+	inline const float* greenRow(int y) const { return &green[index(0, y)]; }
+	inline const float* blueRow(int y) const { return &blue[index(0, y)]; }
+	inline const int* countRow(int y) const { return &counts[index(0, y)]; }
+
+private:
+
+	inline int index(int x, int y) const
+	{
+		return (y - filmFirstRow) * filmWidth + x;
+	}
+
+	inline Vector3 sum(int i) const
+	{
+		return Vector3(red[i], green[i], blue[i]);
+	}
+
+	int filmWidth;
+	int filmHeight;
+	int filmFirstRow;
+	std::vector<float> red;			// sums of radiance
+	std::vector<float> green;
+	std::vector<float> blue;
+	std::vector<float> luminanceSquares;
+	std::vector<int> counts;
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <float.h>
+
+/////////////////////////////////////////////////////////////////
+//
+// class FrameBudget - picks how much to render per frame so the
+// interactive windows keep to a frame time.
+//
+// It learns what a unit of work (one sample of one pixel) costs
+// from the frames it is told about, smoothed over the last few, and
+// answers with the resolution or samples per pixel that fit in the
+// budget. Only frames rendered while the view is changing need to
+// hold to it; when idle the caller goes back to full quality.
+//
+// It also keeps the frame rate actually achieved, from the time
+// between frames, which is what gets reported.
+//
+/////////////////////////////////////////////////////////////////
+
+// Aim for this fraction of the budget, to leave room for the cost going up a little
+const double FrameBudgetHeadroom = 0.85;
+
+// Weight of the newest frame in the running estimates
+const double FrameBudgetSmoothing = 0.25;
+
+class FrameBudget
+{
+public:
+
+	explicit FrameBudget(float targetSeconds) :
+		target(targetSeconds),
+		secondsPerWork(0.0),
+		frameSeconds(0.0),
+		framesSinceReport(0),
+		started(false),
+		lastFrame(clock::now()),
+		lastReport(lastFrame)
+	{
+	}
+
+	// After each frame: how long rendering took and how many pixel samples it did
+	void frameDone(float renderSeconds, double work)
+	{
+		if (work > 0.0)
+		{
+			double cost = renderSeconds / work;
+			secondsPerWork = secondsPerWork > 0.0 ? secondsPerWork + (cost - secondsPerWork) * FrameBudgetSmoothing : cost;
+		}
+
+		// The frame rate needs two frames to time the gap between
+		clock::time_point now = clock::now();
+		if (started)
+		{
+			double seconds = std::chrono::duration<double>(now - lastFrame).count();
+			frameSeconds = frameSeconds > 0.0 ? frameSeconds + (seconds - frameSeconds) * FrameBudgetSmoothing : seconds;
+			framesSinceReport++;
+		}
+		else
+		{
+			lastReport = now;
+		}
+		lastFrame = now;
+		started = true;
+	}
+
+	// Pixel samples a frame can take and stay in budget; unlimited until a frame has been measured
+	double workBudget() const
+	{
+		return secondsPerWork > 0.0 ? target * FrameBudgetHeadroom / secondsPerWork : DBL_MAX;
+	}
+
+	// The finest of full resolution (1), 1/2, ... 1/maxScale of width x height that fits
+	int resolutionScale(int width, int height, int maxScale) const
+	{
+		double budget = workBudget();
+		int scale = 1;
+		while (scale < maxScale && double(width / scale) * double(height / scale) > budget)
+		{
+			scale++;
+		}
+		return scale;
+	}
+
+	// The most samples per pixel, from 1 to maxSamples, a width x height frame can take
+	int samplesPerPixel(int width, int height, int maxSamples) const
+	{
+		double samples = workBudget() / (double(width) * double(height));
+		return samples >= maxSamples ? maxSamples : std::max(1, int(samples));
+	}
+
+	// Frames per second achieved lately
+	float fps() const
+	{
+		return frameSeconds > 0.0 ? float(1.0 / frameSeconds) : 0.f;
+	}
+
+	// True about once a second, for printing the frame rate without flooding the console
+	bool reportDue()
+	{
+		clock::time_point now = clock::now();
+		if (framesSinceReport == 0 || now - lastReport < std::chrono::seconds(1))
+		{
+			return false;
+		}
+
+		lastReport = now;
+		framesSinceReport = 0;
+		return true;
+	}
+
+private:
+
+	typedef std::chrono::steady_clock clock;
+
+	float target;
+	double secondsPerWork;
+	double frameSeconds;
+	int framesSinceReport;
+	bool started;
+	clock::time_point lastFrame;
+	clock::time_point lastReport;
+};
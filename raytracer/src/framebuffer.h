@@ -0,0 +1,342 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "SDL.h"
+#include "tgaimage.h"
+#include "tile_scheduler.h"
+
+/////////////////////////////////////////////////////////////////
+//
+// class Framebuffer - what the render threads draw a frame into:
+// 32 bit pixels laid out the way the window wants them (BGRA bytes,
+// SDL_PIXELFORMAT_ARGB8888), filled in by the tile workers (see
+// resolve.h).
+//
+// Every tile of it (on the TileScheduler grid) carries a version,
+// which only changes when the renderer changed the tile (see
+// TileChanges).
+// WindowFramebuffer uses them to send only the tiles that changed
+// to the screen.
+//
+/////////////////////////////////////////////////////////////////
+
+const int FramebufferTileSize = TileScheduler::DefaultTileSize;
+
+class Framebuffer
+{
+public:
+
+	Framebuffer() : fbWidth(0), fbHeight(0), fbTilesX(0), fbTilesY(0) {}
+
+	Framebuffer(int width, int height) : fbWidth(0), fbHeight(0), fbTilesX(0), fbTilesY(0) { resize(width, height); }
+
+	// Also clears. Until TileChanges has seen it, every tile counts as changed once.
+	void resize(int width, int height)
+	{
+		fbWidth = width;
+		fbHeight = height;
+		fbTilesX = (width + FramebufferTileSize - 1) / FramebufferTileSize;
+		fbTilesY = (height + FramebufferTileSize - 1) / FramebufferTileSize;
+		pixels.assign(size_t(width) * height, 0);
+		versions.assign(size_t(fbTilesX) * fbTilesY, 1);
+	}
+
+	inline const uint32_t* row(int y) const { return &pixels[size_t(y) * fbWidth]; }
+	inline uint32_t* row(int y) { return &pixels[size_t(y) * fbWidth]; }
+
+	inline int width() const { return fbWidth; }
+	inline int height() const { return fbHeight; }
+	inline int tilesX() const { return fbTilesX; }
+	inline int tilesY() const { return fbTilesY; }
+
+	inline unsigned tileVersion(int tile) const { return versions[tile]; }
+
+	// Tiles of a width x height frame, and the index among them of a TileScheduler tile (of the
+	// default size), for renderers to say which tiles they changed without the frame at hand
+	static inline int tileCount(int width, int height)
+	{
+		return ((width + FramebufferTileSize - 1) / FramebufferTileSize) * ((height + FramebufferTileSize - 1) / FramebufferTileSize);
+	}
+
+	static inline int tileIndex(const Tile& tile, int width)
+	{
+		return (tile.y0 / FramebufferTileSize) * ((width + FramebufferTileSize - 1) / FramebufferTileSize) + tile.x0 / FramebufferTileSize;
+	}
+
+	// Pixels of tile (tx, ty)
+	SDL_Rect tileRect(int tx, int ty) const
+	{
+		SDL_Rect rect = { tx * FramebufferTileSize, ty * FramebufferTileSize, 0, 0 };
+		rect.w = std::min(FramebufferTileSize, fbWidth - rect.x);
+		rect.h = std::min(FramebufferTileSize, fbHeight - rect.y);
+		return rect;
+	}
+
+	// For writing the frame out
+	void copyTo(TGAImage& image) const
+	{
+		image = TGAImage(fbWidth, fbHeight, TGAImage::RGBA);
+		memcpy(image.buffer(), pixels.data(), pixels.size() * sizeof(uint32_t));
+	}
+
+private:
+	friend class TileChanges;
+
+	int fbWidth;
+	int fbHeight;
+	int fbTilesX;
+	int fbTilesY;
+	std::vector<uint32_t> pixels;
+	std::vector<unsigned> versions;		// per tile
+};
+
+/////////////////////////////////////////////////////////////////
+//
+// class TileChanges - numbers the versions of a render thread's
+// frames' tiles.
+//
+// The frames take turns in the buffers of a TripleBuffer, so a
+// buffer's own last contents say nothing about the frame before it.
+// This keeps the version of every tile as of the last frame it saw
+// instead. The renderer says which tiles it changed since then
+// (it knows, which is cheaper than comparing the pixels); those get
+// the frame's number as their new version.
+//
+// One per frame size, owned by the thread that renders the frames.
+//
+/////////////////////////////////////////////////////////////////
+
+class TileChanges
+{
+public:
+
+	TileChanges() : frameNumber(1), width(0), height(0) {}
+
+	// After frame has been drawn, before it is published. changed has a flag per tile of frame
+	// (see Framebuffer::tileIndex), non zero for those that may differ from the last frame; NULL
+	// for all of them. After a resize every tile counts as changed.
+	void update(Framebuffer& frame, const std::vector<uint8_t>* changed = NULL)
+	{
+		frameNumber++;
+		bool resized = frame.width() != width || frame.height() != height;
+		if (resized)
+		{
+			width = frame.width();
+			height = frame.height();
+			versions.assign(frame.versions.size(), frameNumber);
+		}
+
+		for (size_t tile = 0; tile < versions.size(); tile++)
+		{
+			if (!changed || (*changed)[tile])
+			{
+				versions[tile] = frameNumber;
+			}
+			frame.versions[tile] = versions[tile];
+		}
+	}
+
+private:
+
+	unsigned frameNumber;
+	int width;
+	int height;
+	std::vector<unsigned> versions;
+};
+
+/////////////////////////////////////////////////////////////////
+//
+// class WindowFramebuffer - shows Framebuffers in a window that a
+// software renderer draws on.
+//
+// A frame the size of the window is copied straight into the window
+// surface, when that has the frame's pixel layout, and only the
+// rectangles that changed are updated on screen. Other sizes go
+// into a streaming texture of their size (locked a run of tiles at
+// a time) and are stretched over the window. Either way only the
+// tiles whose version differs from what the surface or texture
+// holds are copied.
+//
+// SDL thread only.
+//
+/////////////////////////////////////////////////////////////////
+
+class WindowFramebuffer
+{
+public:
+
+	WindowFramebuffer() : window(NULL), renderer(NULL), shown(NULL) {}
+
+	~WindowFramebuffer()
+	{
+		for (auto iter = textures.begin(); iter != textures.end(); ++iter)
+		{
+			SDL_DestroyTexture(iter->texture);
+		}
+	}
+
+	// renderer must draw on window's surface
+	void create(SDL_Window* window, SDL_Renderer* renderer)
+	{
+		this->window = window;
+		this->renderer = renderer;
+	}
+
+	void present(const Framebuffer& frame)
+	{
+		SDL_Surface* surface = SDL_GetWindowSurface(window);
+		if (frame.width() == surface->w && frame.height() == surface->h &&
+			(surface->format->format == SDL_PIXELFORMAT_ARGB8888 || surface->format->format == SDL_PIXELFORMAT_RGB888))
+		{
+			presentToSurface(frame, surface);
+			return;
+		}
+
+		Target& target = textureFor(frame);
+		bool changed = dirtyRuns(frame, target, runs);
+		if (!changed && shown == &target)
+		{
+			return;
+		}
+
+		for (auto iter = runs.begin(); iter != runs.end(); ++iter)
+		{
+			void* pixels;
+			int pitch;
+			if (SDL_LockTexture(target.texture, &*iter, &pixels, &pitch) == 0)
+			{
+				copyRect(frame, *iter, pixels, pitch);
+				SDL_UnlockTexture(target.texture);
+			}
+		}
+
+		SDL_RenderClear(renderer);
+		SDL_RenderCopy(renderer, target.texture, NULL, NULL);
+		SDL_RenderPresent(renderer);
+		SDL_UpdateWindowSurface(window);
+
+		// The surface has to be drawn in full next time it gets a frame of its own
+		surfaceTarget.versions.clear();
+		shown = &target;
+	}
+
+private:
+
+	// Something the frames are copied to, with the versions of the tiles it holds
+	struct Target
+	{
+		Target() : texture(NULL), width(0), height(0) {}
+
+		SDL_Texture* texture;
+		int width;
+		int height;
+		std::vector<unsigned> versions;
+	};
+
+	void presentToSurface(const Framebuffer& frame, SDL_Surface* surface)
+	{
+		if (!dirtyRuns(frame, surfaceTarget, runs))
+		{
+			return;
+		}
+
+		if (SDL_MUSTLOCK(surface) && SDL_LockSurface(surface) != 0)
+		{
+			surfaceTarget.versions.clear();
+			return;
+		}
+
+		for (auto iter = runs.begin(); iter != runs.end(); ++iter)
+		{
+			uint8_t* pixels = (uint8_t*)surface->pixels + iter->y * surface->pitch + iter->x * sizeof(uint32_t);
+			copyRect(frame, *iter, pixels, surface->pitch);
+		}
+
+		if (SDL_MUSTLOCK(surface))
+		{
+			SDL_UnlockSurface(surface);
+		}
+
+		SDL_UpdateWindowSurfaceRects(window, runs.data(), int(runs.size()));
+		shown = &surfaceTarget;
+	}
+
+	Target& textureFor(const Framebuffer& frame)
+	{
+		for (auto iter = textures.begin(); iter != textures.end(); ++iter)
+		{
+			if (iter->width == frame.width() && iter->height == frame.height())
+			{
+				return *iter;
+			}
+		}
+
+		Target target;
+		target.texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, frame.width(), frame.height());
+		target.width = frame.width();
+		target.height = frame.height();
+		textures.push_back(target);
+		return textures.back();
+	}
+
+	// Fills runs with the changed tiles of frame, joined along each row of tiles, and marks
+	// them as held by target. False if there are none.
+	static bool dirtyRuns(const Framebuffer& frame, Target& target, std::vector<SDL_Rect>& runs)
+	{
+		size_t numTiles = size_t(frame.tilesX()) * frame.tilesY();
+		if (target.versions.size() != numTiles)
+		{
+			// Version 0 is never given out, so everything is copied
+			target.versions.assign(numTiles, 0);
+		}
+
+		runs.clear();
+		for (int ty = 0; ty < frame.tilesY(); ty++)
+		{
+			bool extending = false;
+			for (int tx = 0; tx < frame.tilesX(); tx++)
+			{
+				int tile = ty * frame.tilesX() + tx;
+				if (target.versions[tile] == frame.tileVersion(tile))
+				{
+					extending = false;
+					continue;
+				}
+
+				target.versions[tile] = frame.tileVersion(tile);
+				SDL_Rect rect = frame.tileRect(tx, ty);
+				if (extending)
+				{
+					runs.back().w += rect.w;
+				}
+				else
+				{
+					runs.push_back(rect);
+					extending = true;
+				}
+			}
+		}
+		return !runs.empty();
+	}
+
+	// Copies rect of frame to pixels, which is where rect's top left corner goes
+	static void copyRect(const Framebuffer& frame, const SDL_Rect& rect, void* pixels, int pitch)
+	{
+		uint8_t* to = (uint8_t*)pixels;
+		for (int y = rect.y; y < rect.y + rect.h; y++, to += pitch)
+		{
+			memcpy(to, frame.row(y) + rect.x, rect.w * sizeof(uint32_t));
+		}
+	}
+
+	SDL_Window* window;
+	SDL_Renderer* renderer;
+	Target surfaceTarget;
+	std::deque<Target> textures;		// a deque so shown stays valid
+	const Target* shown;			// what the window shows now
+	std::vector<SDL_Rect> runs;
+};
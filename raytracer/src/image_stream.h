@@ -0,0 +1,209 @@
+#pragma once
+
+#include <fstream>
+#include <iostream>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "film.h"
+#include "framebuffer.h"
+#include "resolve.h"
+#include "tgaimage.h"
+
+/////////////////////////////////////////////////////////////////
+//
+// class ImageStreamWriter - writes an image to disk a band of rows
+// at a time, as the bands are rendered, so the whole image never
+// has to be in memory.
+//
+// Bands come in as Films (see Film::resize), bottom row first, and
+// each is written as soon as it arrives:
+//
+// Tga / TgaRle  8 bit BGRA TGA, resolved with the given settings.
+//               Stored bottom-left origin, so the rows go out in
+//               the order they come. RLE packets don't cross rows.
+// Pfm           Portable float map: the mean radiance of every
+//               pixel as little endian float RGB, bottom row first,
+//               with nothing done to it.
+//
+/////////////////////////////////////////////////////////////////
+
+enum class StreamFormat
+{
+	Tga,
+	TgaRle,
+	Pfm
+};
+
+class ImageStreamWriter
+{
+public:
+
+	ImageStreamWriter() : format(StreamFormat::Tga), width(0), height(0), rowsWritten(0) {}
+
+	~ImageStreamWriter()
+	{
+		if (out.is_open())
+		{
+			out.close();
+		}
+	}
+
+	bool open(const char* filename, StreamFormat format, int width, int height)
+	{
+		if (format != StreamFormat::Pfm && (width > 0xffff || height > 0xffff))
+		{
+			std::cerr << "TGA can't be larger than 65535 x 65535\n";
+			return false;
+		}
+
+		out.open(filename, std::ios::binary);
+		if (!out.is_open())
+		{
+			std::cerr << "can't open file " << filename << "\n";
+			return false;
+		}
+
+		this->format = format;
+		this->width = width;
+		this->height = height;
+		rowsWritten = 0;
+
+		if (format == StreamFormat::Pfm)
+		{
+			// A negative scale means little endian
+			out << "PF\n" << width << " " << height << "\n-1.0\n";
+		}
+		else
+		{
+			TGA_Header header;
+			memset((void*)&header, 0, sizeof(header));
+			header.bitsperpixel = TGAImage::RGBA << 3;
+			header.width = short(uint16_t(width));
+			header.height = short(uint16_t(height));
+			header.datatypecode = format == StreamFormat::TgaRle ? 10 : 2;
+			header.imagedescriptor = 0; // bottom-left origin
+			out.write((char*)&header, sizeof(header));
+		}
+		return check();
+	}
+
+	// The next band of rows, which must start where the last one ended. settings are for TGA,
+	// threads for the resolve (see ResolveFilm).
+	bool write(const Film& band, const ResolveSettings& settings, int threads = 0)
+	{
+		if (band.width() != width || band.firstRow() != rowsWritten || rowsWritten + band.height() > height)
+		{
+			std::cerr << "bands have to come in order, and fit the image\n";
+			return false;
+		}
+
+		buffer.clear();
+		if (format == StreamFormat::Pfm)
+		{
+			encodeFloat(band);
+		}
+		else
+		{
+			if (pixels.width() != width || pixels.height() != band.height())
+			{
+				pixels.resize(width, band.height());
+			}
+			ResolveFilm(band, settings, pixels, threads);
+			if (format == StreamFormat::TgaRle)
+			{
+				encodeRle();
+			}
+			else
+			{
+				for (int y = 0; y < band.height(); y++)
+				{
+					append(pixels.row(y), width * sizeof(uint32_t));
+				}
+			}
+		}
+
+		out.write((const char*)buffer.data(), buffer.size());
+		rowsWritten += band.height();
+		return check();
+	}
+
+	// Once all the rows are in
+	bool close()
+	{
+		if (rowsWritten != height)
+		{
+			std::cerr << "only " << rowsWritten << " of " << height << " rows were written\n";
+			out.close();
+			return false;
+		}
+
+		if (format != StreamFormat::Pfm)
+		{
+			// Same footer as TGAImage::write_tga_file: no developer or extension area
+			unsigned char areas[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+			unsigned char footer[18] = { 'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0' };
+			out.write((char*)areas, sizeof(areas));
+			out.write((char*)footer, sizeof(footer));
+		}
+
+		bool good = check();
+		out.close();
+		return good;
+	}
+
+private:
+
+	bool check()
+	{
+		if (!out.good())
+		{
+			std::cerr << "can't write the image\n";
+			return false;
+		}
+		return true;
+	}
+
+	void append(const void* bytes, size_t count)
+	{
+		const uint8_t* from = (const uint8_t*)bytes;
+		buffer.insert(buffer.end(), from, from + count);
+	}
+
+	// A row at a time, so packets don't cross rows
+	void encodeRle()
+	{
+		buffer.resize(TGAImage::rle_bound(size_t(width) * pixels.height(), TGAImage::RGBA));
+		size_t length = 0;
+		for (int y = 0; y < pixels.height(); y++)
+		{
+			length += TGAImage::encode_rle((const unsigned char*)pixels.row(y), width, TGAImage::RGBA, &buffer[length]);
+		}
+		buffer.resize(length);
+	}
+
+	void encodeFloat(const Film& band)
+	{
+		size_t start = buffer.size();
+		buffer.resize(start + size_t(band.height()) * width * 3 * sizeof(float));
+		float* rgb = (float*)&buffer[start];
+		for (int y = band.firstRow(); y < band.firstRow() + band.height(); y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				Vector3 mean = band.average(x, y);
+				*rgb++ = mean.x;
+				*rgb++ = mean.y;
+				*rgb++ = mean.z;
+			}
+		}
+	}
+
+	std::ofstream out;
+	StreamFormat format;
+	int width;
+	int height;
+	int rowsWritten;
+	Framebuffer pixels;				// a band, resolved
+	std::vector<uint8_t> buffer;	// a band, encoded
+};
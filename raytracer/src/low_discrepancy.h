@@ -0,0 +1,299 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+/////////////////////////////////////////////////////////////////
+//
+// Building blocks for the low discrepancy samplers in sampler.h:
+// a 4D Sobol sequence with Owen scrambling, hashed permutations for
+// stratification, and a blue noise mask made by void-and-cluster.
+//
+/////////////////////////////////////////////////////////////////
+
+namespace LowDiscrepancy
+{
+	inline uint32_t reverseBits(uint32_t x)
+	{
+		x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+		x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+		x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+		x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+		return (x >> 16) | (x << 16);
+	}
+
+	// Murmur3 style finaliser, combines value into seed
+	inline uint32_t hashCombine(uint32_t seed, uint32_t value)
+	{
+		uint32_t h = seed ^ (value * 0xcc9e2d51u);
+		h ^= h >> 16;
+		h *= 0x85ebca6bu;
+		h ^= h >> 13;
+		h *= 0xc2b2ae35u;
+		h ^= h >> 16;
+		return h;
+	}
+
+	// Top 24 bits as a float in [0, 1)
+	inline float toUnitFloat(uint32_t x)
+	{
+		return float(x >> 8) * (1.f / 16777216.f);
+	}
+
+	// Owen scrambling of x, as a hash based permutation of its reversed bits
+	// (Burley, "Practical Hash-based Owen Scrambling", 2020)
+	inline uint32_t nestedUniformScramble(uint32_t x, uint32_t seed)
+	{
+		x = reverseBits(x);
+		x += seed;
+		x ^= x * 0x6c50b47cu;
+		x ^= x * 0xb82f1e52u;
+		x ^= x * 0xc7afe638u;
+		x ^= x * 0x8d22f6e6u;
+		return reverseBits(x);
+	}
+
+	// Direction numbers for the first 4 Sobol dimensions (Joe & Kuo), expanded on first use
+	struct SobolTable
+	{
+		static const int Dimensions = 4;
+		uint32_t directions[Dimensions][32];
+
+		SobolTable()
+		{
+			// Dimension 0 is the van der Corput sequence
+			for (int i = 0; i < 32; i++)
+			{
+				directions[0][i] = 1u << (31 - i);
+			}
+
+			// s, a and m_1..m_s for each following dimension
+			const uint32_t s[3] = { 1, 2, 3 };
+			const uint32_t a[3] = { 0, 1, 1 };
+			const uint32_t m[3][3] = { { 1 }, { 1, 3 }, { 1, 3, 1 } };
+			for (int d = 1; d < Dimensions; d++)
+			{
+				uint32_t* v = directions[d];
+				uint32_t degree = s[d - 1];
+				for (uint32_t i = 0; i < degree; i++)
+				{
+					v[i] = m[d - 1][i] << (31 - i);
+				}
+
+				for (uint32_t i = degree; i < 32; i++)
+				{
+					v[i] = v[i - degree] ^ (v[i - degree] >> degree);
+					for (uint32_t k = 1; k < degree; k++)
+					{
+						v[i] ^= ((a[d - 1] >> (degree - 1 - k)) & 1u) * v[i - k];
+					}
+				}
+			}
+		}
+
+		static const SobolTable& get()
+		{
+			static const SobolTable table;
+			return table;
+		}
+	};
+
+	inline uint32_t sobol(uint32_t index, int dimension)
+	{
+		const uint32_t* v = SobolTable::get().directions[dimension];
+		uint32_t x = 0;
+		for (int bit = 0; index != 0; bit++, index >>= 1)
+		{
+			if (index & 1u)
+			{
+				x ^= v[bit];
+			}
+		}
+
+		return x;
+	}
+
+	// Component of the index-th point of a shuffled, Owen scrambled 4D Sobol sequence.
+	// Different seeds give statistically independent sequences, which is used both to
+	// decorrelate pixels and to pad dimensions past 4 with fresh 4D sets.
+	inline uint32_t scrambledSobol(uint32_t index, int component, uint32_t seed)
+	{
+		uint32_t shuffled = nestedUniformScramble(index, seed);
+		return nestedUniformScramble(sobol(shuffled, component), hashCombine(seed, uint32_t(component)));
+	}
+
+	// Hashed permutation of i within [0, l) (Kensler, "Correlated Multi-Jittered Sampling", 2013)
+	inline uint32_t permute(uint32_t i, uint32_t l, uint32_t p)
+	{
+		uint32_t w = l - 1;
+		w |= w >> 1;
+		w |= w >> 2;
+		w |= w >> 4;
+		w |= w >> 8;
+		w |= w >> 16;
+		do
+		{
+			i ^= p; i *= 0xe170893du;
+			i ^= p >> 16;
+			i ^= (i & w) >> 4;
+			i ^= p >> 8; i *= 0x0929eb3fu;
+			i ^= p >> 23;
+			i ^= (i & w) >> 1; i *= 1 | p >> 27;
+			i *= 0x6935fa69u;
+			i ^= (i & w) >> 11; i *= 0x74dcb303u;
+			i ^= (i & w) >> 2; i *= 0x9e501cc3u;
+			i ^= (i & w) >> 2; i *= 0xc860a3dfu;
+			i &= w;
+			i ^= i >> 5;
+		} while (i >= l);
+
+		return (i + p) % l;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	//
+	// BlueNoiseMask - Size x Size tileable blue noise, values in [0, 1).
+	// Generated once with Ulichney's void-and-cluster method: pixels
+	// are ranked by repeatedly filling the largest void (or emptying
+	// the tightest cluster) of a Gaussian filtered binary pattern.
+	//
+	/////////////////////////////////////////////////////////////////
+
+	class BlueNoiseMask
+	{
+	public:
+
+		static const int Size = 64;
+
+		inline float at(int x, int y) const
+		{
+			return values[(y & (Size - 1)) * Size + (x & (Size - 1))];
+		}
+
+		static const BlueNoiseMask& get()
+		{
+			static const BlueNoiseMask mask;
+			return mask;
+		}
+
+	private:
+
+		static const int Count = Size * Size;
+
+		std::vector<float> values;
+		std::vector<float> gaussian;	// filter weight for each toroidal offset
+		std::vector<float> energy;		// filtered binary pattern
+		std::vector<char> pattern;
+
+		BlueNoiseMask() : values(Count), gaussian(Count), energy(Count), pattern(Count)
+		{
+			const float sigma = 1.5f;
+			for (int y = 0; y < Size; y++)
+			{
+				for (int x = 0; x < Size; x++)
+				{
+					int dx = x < Size / 2 ? x : x - Size;
+					int dy = y < Size / 2 ? y : y - Size;
+					gaussian[y * Size + x] = expf(-float(dx * dx + dy * dy) / (2.f * sigma * sigma));
+				}
+			}
+
+			// Initial pattern: 10% of the pixels, picked by a fixed hash so the mask is always the same
+			int initialCount = Count / 10;
+			int placed = 0;
+			for (uint32_t i = 0; placed < initialCount; i++)
+			{
+				int p = int(hashCombine(0x5eedu, i) % Count);
+				if (!pattern[p])
+				{
+					toggle(p);
+					placed++;
+				}
+			}
+
+			// Relax it: move the tightest cluster into the largest void until that stops changing anything
+			for (int iteration = 0; iteration < Count; iteration++)
+			{
+				int cluster = tightestCluster();
+				toggle(cluster);
+				int largestVoid = largestVoidPixel();
+				toggle(largestVoid);
+				if (largestVoid == cluster)
+				{
+					break;
+				}
+			}
+
+			std::vector<char> prototype = pattern;
+			std::vector<float> prototypeEnergy = energy;
+			std::vector<int> rank(Count, 0);
+
+			// Phase 1: rank the initial points by taking out the tightest cluster first
+			for (int r = initialCount - 1; r >= 0; r--)
+			{
+				int cluster = tightestCluster();
+				toggle(cluster);
+				rank[cluster] = r;
+			}
+
+			// Phases 2 and 3: rank the rest by filling the largest void. With a fixed filter the
+			// tightest cluster of empty pixels is the same as the largest void of filled ones.
+			pattern = prototype;
+			energy = prototypeEnergy;
+			for (int r = initialCount; r < Count; r++)
+			{
+				int largestVoid = largestVoidPixel();
+				toggle(largestVoid);
+				rank[largestVoid] = r;
+			}
+
+			for (int i = 0; i < Count; i++)
+			{
+				values[i] = (float(rank[i]) + 0.5f) / float(Count);
+			}
+		}
+
+		void toggle(int p)
+		{
+			float sign = pattern[p] ? -1.f : 1.f;
+			pattern[p] = !pattern[p];
+
+			int px = p % Size, py = p / Size;
+			for (int y = 0; y < Size; y++)
+			{
+				const float* row = &gaussian[((y - py) & (Size - 1)) * Size];
+				for (int x = 0; x < Size; x++)
+				{
+					energy[y * Size + x] += sign * row[(x - px) & (Size - 1)];
+				}
+			}
+		}
+
+		int tightestCluster() const
+		{
+			int best = -1;
+			for (int i = 0; i < Count; i++)
+			{
+				if (pattern[i] && (best < 0 || energy[i] > energy[best]))
+				{
+					best = i;
+				}
+			}
+			return best;
+		}
+
+		int largestVoidPixel() const
+		{
+			int best = -1;
+			for (int i = 0; i < Count; i++)
+			{
+				if (!pattern[i] && (best < 0 || energy[i] < energy[best]))
+				{
+					best = i;
+				}
+			}
+			return best;
+		}
+	};
+};
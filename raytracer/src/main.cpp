@@ -4,118 +4,675 @@
 #include "tgaimage.h"
 #include "ray.h"
 #include "surface.h"
-#include "surface_group.h"
+#include "bvh.h"
 #include "sphere.h"
 #include "utils.h"
 #include "material.h"
+#include "tile_scheduler.h"
+#include "film.h"
+#include "config.h"
+#include "wavefront.h"
+#include "temporal.h"
+#include "frame_budget.h"
+#include "triple_buffer.h"
+#include "framebuffer.h"
+#include "resolve.h"
+#include "image_stream.h"
+#include "sphere_kernels.h"
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <mutex>
 #include <stdlib.h>
+#include <string.h>
+#include <thread>
 #include <time.h>
 
 // SDL
 SDL_Window* window;
 SDL_Renderer* renderer;
 int done = 1;
-float lastTime;
 std::string label("metals");
 
-struct Config
-{
-	int nx, ny, ns;
-	Vector3 lowerLeft;
-	Vector3 horizontal;
-	Vector3 vertical;
-	Vector3 origin;
-};
+// Fewer samples than this and the variance estimate isn't worth trusting
+const int MinAdaptiveSamples = 8;
 
-Vector3 color(const Ray& r, const Surface* world, int depth) {
+// Progressive preview: samples keep adding up in the film for as long as
+// the world and the camera it was rendered with stay the same
+Film film;
+Config filmConfig;
+const Surface* filmWorld = NULL;
+long long filmNoisyPixels = 0;		// left for adaptive sampling, see RenderAdaptivePass
+std::vector<uint8_t> filmChangedTiles;	// since the preview last showed the film, for TileChanges
 
-	hit_record rec;
-	if (world->hit(r, 0.001, std::numeric_limits < float >::max(), rec))
+// Moves the film's samples along with the camera
+TemporalReprojection filmHistory;
+
+// How the film is shown and written out: clamped, gamma 2, no dither
+const ResolveSettings FilmResolve = { 1.f, Tonemap::Clamp, Gamma::Two, false };
+
+// Rows rendered (and held in memory) at a time when rendering straight to a file
+const int StreamBandRows = 2 * TileScheduler::DefaultTileSize;
+
+// While the camera moves the preview takes only as many samples per frame as fit in this
+const float FrameBudgetSeconds = 1.f / 30.f;
+FrameBudget frameBudget(FrameBudgetSeconds);
+
+// Traces one path, carrying the product of the attenuations along it (the throughput)
+// instead of recursing per bounce. This one takes a camera ray that has already been
+// intersected: hit says whether it hit anything and rec is where.
+Vector3 color(const Ray& r, bool hit, const hit_record& firstHit, const Surface* world, const MaterialTable& materials, const Config& c, Sampler& sampler) {
+
+	Ray ray(r);
+	Vector3 throughput(1.f);
+	hit_record rec(firstHit);
+	for (int depth = 0; ; depth++)
 	{
+		if (!hit)
+		{
+			return throughput * Utils::skyColor(ray.direction());
+		}
+
 		Ray scattered;
 		Vector3 attenuation;
-		
-		if (depth < 50 && rec.mat->scatter(r, rec, attenuation, scattered))
+
+		sampler.startBounce(depth + 1);
+		if (depth >= c.maxDepth || !materials.scatter(ray, rec, attenuation, scattered, sampler))
 		{
-			return attenuation * color(scattered, world, depth + 1);
+			return Vector3(0.f);
 		}
-		else
+
+		throughput = throughput * attenuation;
+		if (depth + 1 >= c.rrStartDepth && !Utils::russianRoulette(throughput, sampler))
 		{
 			return Vector3(0.f);
 		}
+
+		ray = scattered;
+		hit = world->hit(ray, 0.001, std::numeric_limits < float >::max(), rec);
 	}
-	else
+}
+
+Vector3 color(const Ray& r, const Surface* world, const MaterialTable& materials, const Config& c, Sampler& sampler) {
+
+	hit_record rec;
+	bool hit = world->hit(r, 0.001, std::numeric_limits < float >::max(), rec);
+	return color(r, hit, rec, world, materials, c, sampler);
+}
+
+// Estimated error of the pixel as displayed. Through gamma 2 a luminance error e around
+// the mean m comes out as about e / (2 sqrt(m)).
+float PixelError(const Film& film, int x, int y)
+{
+	if (film.samples(x, y) < MinAdaptiveSamples)
+	{
+		return INFINITY;
+	}
+
+	float mean = Film::luminance(film.average(x, y));
+	return film.standardError(x, y) / (2.f * sqrtf(mean) + 1e-3f);
+}
+
+// Traces the samples for the pixels of a tile (as listed by RenderWorldTile) with the camera rays
+// in packets: one per 8x8 block of pixels and sample index
+void TracePixelsInPackets(const Surface& world, const MaterialTable& materials, const Config& c, const Tile& tile, const std::vector<PixelSamples>& pixels, std::vector<Vector3>& radiance)
+{
+	// pixels go through the tile row by row, from the top
+	int tileWidth = tile.x1 - tile.x0;
+	std::vector<int> offsets(pixels.size());
+	int totalSamples = 0;
+	for (size_t p = 0; p < pixels.size(); p++)
 	{
-		Vector3 unitDir(r.direction());
-		unitDir.normalized();
-		float t = 0.5f * (unitDir.y + 1.f);
-		return (1.f - t) * Vector3(1.0, 1.0, 1.0) + t * Vector3(0.5f, 0.7f, 1.f);
+		offsets[p] = totalSamples;
+		totalSamples += pixels[p].count;
+	}
+	radiance.resize(totalSamples);
+
+	std::unique_ptr<Sampler> sampler(Sampler::create(c.sampler, c.seed, c.ns));
+	RayPacket packet;
+	packet.origin = c.origin;
+	int packetPixels[RayPacket::MaxRays];
+	float tMax[RayPacket::MaxRays];
+	hit_record recs[RayPacket::MaxRays];
+	bool hits[RayPacket::MaxRays];
+
+	for (int y0 = tile.y0; y0 < tile.y1; y0 += RayPacket::Width)
+	{
+		for (int x0 = tile.x0; x0 < tile.x1; x0 += RayPacket::Width)
+		{
+			int x1 = std::min(x0 + RayPacket::Width, tile.x1);
+			int y1 = std::min(y0 + RayPacket::Width, tile.y1);
+
+			// Jittered rays stay inside their pixels, so the block's edges (plus a little) bound them all
+			const float margin = 0.01f;
+			float u0 = (x0 - margin) / float(c.nx), u1 = (x1 + margin) / float(c.nx);
+			float v0 = (y0 - margin) / float(c.ny), v1 = (y1 + margin) / float(c.ny);
+			Vector3 corners[4] = {
+				c.lowerLeft + u0 * c.horizontal + v0 * c.vertical,
+				c.lowerLeft + u1 * c.horizontal + v0 * c.vertical,
+				c.lowerLeft + u1 * c.horizontal + v1 * c.vertical,
+				c.lowerLeft + u0 * c.horizontal + v1 * c.vertical
+			};
+			packet.frustum = Frustum(c.origin, corners);
+
+			int maxCount = 0;
+			for (int j = y0; j < y1; j++)
+			{
+				for (int i = x0; i < x1; i++)
+				{
+					maxCount = std::max(maxCount, pixels[(tile.y1 - 1 - j) * tileWidth + (i - tile.x0)].count);
+				}
+			}
+
+			for (int s = 0; s < maxCount; s++)
+			{
+				packet.count = 0;
+				for (int j = y0; j < y1; j++)
+				{
+					for (int i = x0; i < x1; i++)
+					{
+						int p = (tile.y1 - 1 - j) * tileWidth + (i - tile.x0);
+						if (s >= pixels[p].count)
+						{
+							continue;
+						}
+
+						sampler->startPixelSample(i, j, pixels[p].firstSample + s);
+						float u = (float(i) + Utils::rand_n(*sampler)) / float(c.nx);
+						float v = (float(j) + Utils::rand_n(*sampler)) / float(c.ny);
+						packetPixels[packet.count] = p;
+						packet.add(c.lowerLeft + u * c.horizontal + v * c.vertical);
+					}
+				}
+
+				for (int k = 0; k < packet.count; k++)
+				{
+					tMax[k] = std::numeric_limits < float >::max();
+					hits[k] = false;
+				}
+				world.hitPacket(packet, 0.001f, tMax, recs, hits);
+
+				for (int k = 0; k < packet.count; k++)
+				{
+					const PixelSamples& pixel = pixels[packetPixels[k]];
+					sampler->startPixelSample(pixel.x, pixel.y, pixel.firstSample + s);
+					Ray r(c.origin, packet.direction(k));
+					radiance[offsets[packetPixels[k]] + s] = color(r, hits[k], recs[k], &world, materials, c, *sampler);
+				}
+			}
+		}
 	}
 }
 
-void RenderWorld(const Surface& world, const Config& c, TGAImage& image)
+// Adds samplesPerPixel samples to the pixels of the tile (only to those still above the noise
+// target when sampling adaptively). Returns how many pixels of the tile are still above the
+// noise target; samplesAdded, if given, is set to how many samples went in.
+int RenderWorldTile(const Surface& world, const MaterialTable& materials, const Config& c, Film& film, const Tile& tile, int samplesPerPixel, int* samplesAdded = NULL)
 {
-	TGAColor col;
-	for (int j = c.ny - 1; j >= 0; j--)
+	bool adaptive = c.noiseTarget > 0.f;
+	std::vector<PixelSamples> pixels;
+	int totalSamples = 0;
+	for (int j = tile.y1 - 1; j >= tile.y0; j--)
 	{
-		for (int i = 0; i < c.nx; i++)
+		for (int i = tile.x0; i < tile.x1; i++)
 		{
-			Vector3 cV(0.f);
-			for (int s = 0; s < c.ns; s++)
+			// Carry on with the pixel's sequence where the last pass left it
+			int firstSample = film.samples(i, j);
+			int count = samplesPerPixel;
+			if (adaptive)
 			{
-				float u = (float(i) + Utils::rand_n()) / float(c.nx);
-				float v = (float(j) + Utils::rand_n()) / float(c.ny);
+				count = PixelError(film, i, j) > c.noiseTarget ? std::max(count, MinAdaptiveSamples - firstSample) : 0;
+			}
+
+			PixelSamples pixel = { i, j, firstSample, count };
+			pixels.push_back(pixel);
+			totalSamples += count;
+		}
+	}
+
+	if (samplesAdded)
+	{
+		*samplesAdded = totalSamples;
+	}
+
+	std::vector<Vector3> radiance;
+	if (c.wavefront)
+	{
+		Wavefront(world, materials, c).trace(pixels, radiance);
+	}
+	else if (c.packets)
+	{
+		TracePixelsInPackets(world, materials, c, tile, pixels, radiance);
+	}
+	else
+	{
+		radiance.reserve(totalSamples);
+		std::unique_ptr<Sampler> sampler(Sampler::create(c.sampler, c.seed, c.ns));
+		for (size_t p = 0; p < pixels.size(); p++)
+		{
+			const PixelSamples& pixel = pixels[p];
+			for (int s = pixel.firstSample; s < pixel.firstSample + pixel.count; s++)
+			{
+				sampler->startPixelSample(pixel.x, pixel.y, s);
+				float u = (float(pixel.x) + Utils::rand_n(*sampler)) / float(c.nx);
+				float v = (float(pixel.y) + Utils::rand_n(*sampler)) / float(c.ny);
 
 				Ray r(c.origin, c.lowerLeft + u * c.horizontal + v * c.vertical);
-				cV += color(r, &world, 0);
+				radiance.push_back(color(r, &world, materials, c, *sampler));
 			}
-			cV /= c.ns;
+		}
+	}
 
-			// To a first approximation, we can use “gamma 2” which means raising the color to the power
-			// 1 / gamma, or in our simple case ½, which is just square - root:
-			cV = Vector3(sqrtf(cV.x), sqrtf(cV.y), sqrtf(cV.z));
+	int noisy = 0;
+	const Vector3* sample = radiance.data();
+	for (size_t p = 0; p < pixels.size(); p++)
+	{
+		int i = pixels[p].x;
+		int j = pixels[p].y;
+		for (int s = 0; s < pixels[p].count; s++)
+		{
+			film.addSample(i, j, *sample++);
+		}
 
-			int ir = int(255.99f * cV.x);
-			int ig = int(255.99f * cV.y);
-			int ib = int(255.99f * cV.z);
+		if (adaptive && pixels[p].count > 0 && PixelError(film, i, j) > c.noiseTarget)
+		{
+			noisy++;
+		}
+	}
 
-			col.set(ir, ig, ib);
+	return noisy;
+}
 
-			//if (j == 50 && i >= 75 && i <= 85)
-			//{
-			//	printf("i: %d, col: (%d, %d, %d)\n", i, ir, ig, ib);
-			//}
+// Calls renderTile for the tiles of the rows film holds, which may be a band of the image
+void RunFilmTiles(const Config& c, const Film& film, const TileScheduler::TileFunc& renderTile)
+{
+	TileScheduler::shared(c.threads).run(c.nx, film.height(), [&](const Tile& bandTile) {
+		Tile tile = { bandTile.x0, bandTile.y0 + film.firstRow(), bandTile.x1, bandTile.y1 + film.firstRow() };
+		renderTile(tile);
+	});
+}
 
-			image.set(i, j, col);
+// One pass of adaptive sampling: up to c.ns samples for each pixel still noisier than
+// c.noiseTarget, spreading what is left of the budget evenly between them. The budget is for the
+// whole image, a band gets its share. noisyPixels is how many pixels were left after the last
+// pass (all of them before the first, as none has an error estimate yet) and is updated; 0 means
+// done. The tiles that got samples are flagged in changedTiles, if given (see
+// Framebuffer::tileIndex). Returns false if cancelled.
+bool RenderAdaptivePass(const Surface& world, const MaterialTable& materials, const Config& c, Film& film, long long& noisyPixels,
+	const std::atomic<bool>* cancel = NULL, std::vector<uint8_t>* changedTiles = NULL)
+{
+	long long budget = c.sampleBudget > 0 ? c.sampleBudget * film.height() / c.ny : LLONG_MAX;
+	long long remaining = budget - film.totalSamples();
+	if (noisyPixels <= 0 || remaining <= 0)
+	{
+		noisyPixels = 0;
+		return true;
+	}
+
+	int samplesPerPixel = int(std::min<long long>(c.ns, std::max<long long>(1, remaining / noisyPixels)));
+	std::atomic<int> stillNoisy(0);
+	RunFilmTiles(c, film, [&](const Tile& tile) {
+		if (cancel && *cancel)
+		{
+			return;
+		}
+		int samplesAdded = 0;
+		stillNoisy += RenderWorldTile(world, materials, c, film, tile, samplesPerPixel, &samplesAdded);
+		if (changedTiles && samplesAdded > 0)
+		{
+			(*changedTiles)[Framebuffer::tileIndex(tile, c.nx)] = 1;
+		}
+	});
+	if (cancel && *cancel)
+	{
+		return false;
+	}
+	noisyPixels = stillNoisy;
+	return true;
+}
+
+// Setting cancel (from another thread) stops the render after the tiles in progress; returns
+// false if it did. The film then has more samples in some pixels than others, all valid.
+bool RenderWorld(const Surface& world, const MaterialTable& materials, const Config& c, Film& film, const std::atomic<bool>* cancel = NULL)
+{
+	if (c.noiseTarget <= 0.f)
+	{
+		RunFilmTiles(c, film, [&](const Tile& tile) {
+			if (cancel && *cancel)
+			{
+				return;
+			}
+			RenderWorldTile(world, materials, c, film, tile, c.ns);
+		});
+		return !(cancel && *cancel);
+	}
+
+	// Adaptive: keep going over the noisy pixels until none are left or the budget is spent
+	long long noisyPixels = (long long)c.nx * film.height();
+	while (noisyPixels > 0)
+	{
+		if (!RenderAdaptivePass(world, materials, c, film, noisyPixels, cancel))
+		{
+			return false;
 		}
 	}
 
 	//image.flip_vertically();
+	return true;
 }
 
 
-void
-renderLoop(const Surface& world, const Config& config, TGAImage* image, SDL_Texture* framebuffer, bool renderEachFrame = true)
+// Renders view c to filename a band of rows at a time, writing each band out as soon as it is
+// done, so memory doesn't limit the resolution
+bool RenderToFile(const Surface& world, const MaterialTable& materials, const Config& c, const char* filename, StreamFormat format)
 {
-	//if (renderEachFrame)
-	//{
-	//	RenderScene(scene, *image);
-	//	float nowSeconds = scene.utils.secondsSinceRun();
+	ImageStreamWriter writer;
+	if (!writer.open(filename, format, c.nx, c.ny))
+	{
+		return false;
+	}
 
-	//	cout << "FPS: " << 1.f / (nowSeconds - lastTime) << endl;
-	//	lastTime = nowSeconds;
-	//}
+	Film band;
+	for (int y0 = 0; y0 < c.ny; y0 += StreamBandRows)
+	{
+		band.resize(c.nx, std::min(StreamBandRows, c.ny - y0), y0);
+		RenderWorld(world, materials, c, band);
+		if (!writer.write(band, FilmResolve, c.threads))
+		{
+			return false;
+		}
+		printf("\r%d%%", int(100LL * (y0 + band.height()) / c.ny));
+		fflush(stdout);
+	}
+	printf("\n");
+	return writer.close();
+}
 
-	//printf(".");
+// Samples taken per pixel, from blue (fewest) through red to yellow (most)
+void RenderSampleHeatMap(const Film& film, TGAImage& image)
+{
+	float scale = 1.f / float(std::max(1, film.maxSamples()));
+	for (int j = 0; j < film.height(); j++)
+	{
+		for (int i = 0; i < film.width(); i++)
+		{
+			float t = float(film.samples(i, j)) * scale;
+			float r = std::min(1.f, 2.f * t);
+			float g = std::max(0.f, 2.f * t - 1.f);
+			float b = std::max(0.f, 1.f - 2.f * t);
+
+			TGAColor col;
+			col.set(int(255.99f * r), int(255.99f * g), int(255.99f * b));
+			image.set(i, j, col);
+		}
+	}
+}
 
+bool SameView(const Config& a, const Config& b)
+{
+	return a.nx == b.nx && a.ny == b.ny &&
+		a.lowerLeft == b.lowerLeft && a.horizontal == b.horizontal && a.vertical == b.vertical && a.origin == b.origin &&
+		a.seed == b.seed && a.sampler == b.sampler && a.maxDepth == b.maxDepth && a.rrStartDepth == b.rrStartDepth;
+}
+
+// One pass of the progressive preview of view config. The film starts over, or is reprojected
+// if only the camera moved; then samples are added to it. Sets samplesAdded, which is 0 once
+// adaptive sampling has spent its budget. Returns false if cancelled.
+bool RenderPreviewPass(const Surface& world, const MaterialTable& materials, const Config& config, bool restart, long long& samplesAdded, const std::atomic<bool>* cancel)
+{
+	// Start the accumulation over only when what the image shows has changed. If only the
+	// camera moved, keep the samples of what is still in view.
+	bool cameraMoved = !restart && filmWorld == &world && !SameView(filmConfig, config);
+	if (restart || filmWorld != &world || !SameView(filmConfig, config))
+	{
+		if (cameraMoved && TemporalReprojection::compatible(filmConfig, config))
+		{
+			filmHistory.reproject(world, filmConfig, config, film);
+		}
+		else
+		{
+			film.resize(config.nx, config.ny);
+			if (config.temporalHistory > 0)
+			{
+				filmHistory.reset(world, config);
+			}
+		}
+		filmConfig = config;
+		filmWorld = &world;
+		filmNoisyPixels = (long long)config.nx * config.ny;
+		filmChangedTiles.assign(Framebuffer::tileCount(config.nx, config.ny), 1);
+	}
+
+	// A frame that follows the camera only gets the samples that fit in the frame budget. Once it
+	// stops, the next frames go back to the full count (and adaptive sampling) to refine.
+	Config frameConfig = config;
+	if (cameraMoved)
+	{
+		frameConfig.ns = frameBudget.samplesPerPixel(config.nx, config.ny, config.ns);
+		frameConfig.noiseTarget = 0.f;
+	}
+
+	long long samplesBefore = film.totalSamples();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	// Adaptive sampling goes one pass at a time, so that each pass is shown; a pass only changes
+	// the tiles it adds samples to. Otherwise every tile gets samples.
+	bool finished;
+	if (frameConfig.noiseTarget > 0.f)
+	{
+		finished = RenderAdaptivePass(world, materials, frameConfig, film, filmNoisyPixels, cancel, &filmChangedTiles);
+	}
+	else
+	{
+		std::fill(filmChangedTiles.begin(), filmChangedTiles.end(), 1);
+		finished = RenderWorld(world, materials, frameConfig, film, cancel);
+	}
+	float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+	samplesAdded = film.totalSamples() - samplesBefore;
+	if (!finished)
+	{
+		return false;
+	}
+
+	if (samplesAdded > 0)
+	{
+		frameBudget.frameDone(seconds, double(samplesAdded));
+		if (frameBudget.reportDue())
+		{
+			printf("FPS: %.1f (%d samples per pixel)\n", frameBudget.fps(), frameConfig.ns);
+		}
+	}
+	return true;
+}
+
+/////////////////////////////////////////////////////////////////
+//
+// Runs the progressive preview on a thread of its own, so the SDL
+// thread only handles input and shows frames.
+//
+// The SDL thread hands over the view with request(). The render
+// thread keeps adding passes for the newest one and publishes each
+// finished pass through a triple buffer, until adaptive sampling
+// has nothing left to do. A new view interrupts the pass in
+// progress rather than wait for it; so does stop().
+//
+// The film and everything with it belong to the render thread until
+// it is stopped.
+//
+/////////////////////////////////////////////////////////////////
+
+class PreviewRenderer
+{
+public:
+	PreviewRenderer(const Surface& world, const MaterialTable& materials) :
+		world(world),
+		materials(materials),
+		requested(0),
+		completed(0),
+		restartPending(false),
+		finishing(false),
+		quit(false),
+		cancel(false)
+	{
+	}
+
+	~PreviewRenderer()
+	{
+		stop();
+	}
+
+	void start()
+	{
+		thread = std::thread(&PreviewRenderer::run, this);
+	}
+
+	// Renders view config from now on. restart throws away the samples so far, for changes to
+	// the scene; interrupt drops the pass in progress.
+	void request(const Config& config, bool interrupt, bool restart = false)
+	{
+		{
+			std::lock_guard<std::mutex> lock(jobLock);
+			pending = config;
+			restartPending = restartPending || restart;
+			requested++;
+			if (interrupt || restart)
+			{
+				cancel = true;
+			}
+		}
+		jobChanged.notify_all();
+	}
+
+	// Moves front() to the newest frame; false if there is none since the last call
+	bool newFrame()
+	{
+		return frames.update();
+	}
+
+	Framebuffer& front()
+	{
+		return frames.front();
+	}
+
+	// Lets the render thread finish the last view requested (a pass, or all of adaptive
+	// sampling; if it hasn't yet, and wasn't stopped), then waits for it to end
+	void finish()
+	{
+		{
+			std::lock_guard<std::mutex> lock(jobLock);
+			finishing = true;
+		}
+		jobChanged.notify_all();
+
+		if (thread.joinable())
+		{
+			thread.join();
+		}
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(jobLock);
+			quit = true;
+			cancel = true;
+		}
+		jobChanged.notify_all();
+
+		if (thread.joinable())
+		{
+			thread.join();
+		}
+	}
+
+private:
+	void run()
+	{
+		Config config;
+		long long rendering = 0;
+		bool restart = false;
+		bool idle = true;			// nothing to add until the next request
+		TileChanges changes;
+
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(jobLock);
+				jobChanged.wait(lock, [&] { return quit || finishing || requested != rendering || !idle; });
+				if (quit || (finishing && completed == requested))
+				{
+					return;
+				}
+
+				if (requested != rendering)
+				{
+					config = pending;
+					rendering = requested;
+					restart = restartPending;
+					restartPending = false;
+				}
+				cancel = false;
+			}
+
+			Framebuffer& image = frames.back();
+			if (image.width() != config.nx || image.height() != config.ny)
+			{
+				image.resize(config.nx, config.ny);
+			}
+
+			long long samplesAdded = 0;
+			bool finished = RenderPreviewPass(world, materials, config, restart, samplesAdded, &cancel);
+			restart = false;
+			idle = finished && samplesAdded == 0;
+			if (finished && samplesAdded > 0)
+			{
+				ResolveFilm(film, FilmResolve, image, config.threads);
+				changes.update(image, &filmChangedTiles);
+				std::fill(filmChangedTiles.begin(), filmChangedTiles.end(), 0);
+				frames.publish();
+			}
+
+			// A view is done after one pass, or with adaptive sampling once that has nothing to add
+			if (finished && (config.noiseTarget <= 0.f || samplesAdded == 0))
+			{
+				std::lock_guard<std::mutex> lock(jobLock);
+				completed = rendering;
+			}
+		}
+	}
+
+	const Surface& world;
+	const MaterialTable& materials;
+	std::thread thread;
+	TripleBuffer<Framebuffer> frames;
+
+	std::mutex jobLock;
+	std::condition_variable jobChanged;
+	Config pending;
+	long long requested;
+	long long completed;
+	bool restartPending;
+	bool finishing;
+	bool quit;
+	std::atomic<bool> cancel;
+};
+
+// One pass of the SDL thread: handles input, passes view changes on to the preview and shows
+// its newest frame
+void
+renderLoop(const Surface& world, const MaterialTable& materials, Config& config, PreviewRenderer& preview, WindowFramebuffer& windowFramebuffer)
+{
 	// poll events
 	SDL_Event e;
 	bool dirty = false;
+	bool moved = false;
 	while (SDL_PollEvent(&e)) {
 		if (e.type == SDL_QUIT) {
 			done = 1;
+			preview.stop();
 			return;
 		}
 
@@ -128,7 +685,9 @@ renderLoop(const Surface& world, const Config& config, TGAImage* image, SDL_Text
 			float u = float(x) / float(config.nx);
 			float v = float(y) / float(config.ny);
 			Ray r(config.origin, config.lowerLeft + u * config.horizontal + v * config.vertical);
-			Vector3 cV = color(r, &world, 0);
+			std::unique_ptr<Sampler> sampler(Sampler::create(config.sampler, config.seed, config.ns));
+			sampler->startPixelSample(x, y, 0);
+			Vector3 cV = color(r, &world, materials, config, *sampler);
 
 			printf("colour: (%f, %f, %f)\n", cV.x, cV.y, cV.z, cV);
 
@@ -152,40 +711,56 @@ renderLoop(const Surface& world, const Config& config, TGAImage* image, SDL_Text
 				//	break;
 			case SDLK_ESCAPE:
 				done = 1;
+				preview.stop();
 				return;
+			case SDLK_LEFT:
+				config.origin -= config.horizontal * 0.05f;
+				moved = true;
+				break;
+			case SDLK_RIGHT:
+				config.origin += config.horizontal * 0.05f;
+				moved = true;
+				break;
+			case SDLK_UP:
+				config.origin += config.vertical * 0.05f;
+				moved = true;
+				break;
+			case SDLK_DOWN:
+				config.origin -= config.vertical * 0.05f;
+				moved = true;
+				break;
 			default:
 				break;
 			}
 
-			// render frame again if needed
-			RenderWorld(world, config, *image);
+			// handlers that change the scene set dirty, camera moves set moved
 		}
 	}
 
-	RenderWorld(world, config, *image);
-
-
-	// Rendering code goes here
-	SDL_UpdateTexture(framebuffer, NULL, image->buffer(), image->get_width() * image->get_bytespp());
-
-	SDL_RenderClear(renderer);
-	SDL_RenderCopy(renderer, framebuffer, NULL, NULL);
-	SDL_RenderPresent(renderer);
+	if (dirty || moved)
+	{
+		preview.request(config, true, dirty);
+	}
 
+	if (!preview.newFrame())
+	{
+		SDL_Delay(1);
+		return;
+	}
 
-	/* Got everything on rendering surface,
-		now Update the drawing image on window screen */
-	SDL_UpdateWindowSurface(window);
+	// Only the tiles that changed are copied, straight from the frame
+	windowFramebuffer.present(preview.front());
 }
 
 
-
 int SDL_main(int argc, char* argv[]) {
 
+	printf("SIMD kernels: %s\n", CpuFeatures::name(sphereKernels().level));
+
 	int nx = 500;
 	int ny = 250;
 	int ns = 10;
-	srand(time(NULL));
+	unsigned int seed = (unsigned int)time(NULL);
 
 	TGAImage image(nx, ny, TGAImage::RGBA);
 
@@ -194,17 +769,49 @@ int SDL_main(int argc, char* argv[]) {
 	Vector3 vertical(0.f, 2.f, 0.f);
 	Vector3 origin(0.f, 0.f, 0.f);
 
-	Config config = { nx, ny, ns, lowerLeft, horizontal, vertical, origin };
+	// Russian roulette off (rrStartDepth = maxDepth): in this scene most paths escape within a
+	// few bounces, so it adds more variance than it saves time
+	int maxDepth = 50;
+	Config config = { nx, ny, ns, lowerLeft, horizontal, vertical, origin, seed, 0, SamplerType::Sobol, maxDepth, maxDepth, 0.01f, (long long)nx * ny * ns * 2, false, true, 16 };
 
 	Ray r = Ray(Vector3::zero(), Vector3::zero());
 
 	const int numSpheres = 4;
 	Surface* surfaces[numSpheres];
-	surfaces[0] = new Sphere(Vector3(0, 0, -1), 0.5, new Lambertian(Vector3(.8f, .8f, .3f)));
-	surfaces[1] = new Sphere(Vector3(0, -100.5, -1), 100, new Lambertian(Vector3(.8f, .8f, 0.f)));
-	surfaces[2] = new Sphere(Vector3(1, 0, -1), 0.5, new Metal(Vector3(.8f, .6f, .2f)));
-	surfaces[3] = new Sphere(Vector3(-1, 0, -1), 0.5, new Metal(Vector3(.8f, .8f, .8f)));
-	Surface* world = new SurfaceGroup(surfaces, numSpheres);
+	MaterialTable materials;
+	surfaces[0] = new Sphere(Vector3(0, 0, -1), 0.5, materials.add(Material::lambertian(Vector3(.8f, .8f, .3f))));
+	surfaces[1] = new Sphere(Vector3(0, -100.5, -1), 100, materials.add(Material::lambertian(Vector3(.8f, .8f, 0.f))));
+	surfaces[2] = new Sphere(Vector3(1, 0, -1), 0.5, materials.add(Material::metal(Vector3(.8f, .6f, .2f))));
+	surfaces[3] = new Sphere(Vector3(-1, 0, -1), 0.5, materials.add(Material::metal(Vector3(.8f, .8f, .8f))));
+	Surface* world = new BVH(surfaces, numSpheres);
+
+	// raytracer --stream <file> [width height] [--uncompressed]: renders straight to the file,
+	// .pfm for floats or else TGA, without the preview
+	if (argc >= 3 && strcmp(argv[1], "--stream") == 0)
+	{
+		const char* filename = argv[2];
+		int arg = 3;
+		if (argc >= 5 && atoi(argv[3]) > 0 && atoi(argv[4]) > 0)
+		{
+			config.nx = atoi(argv[3]);
+			config.ny = atoi(argv[4]);
+			config.sampleBudget = (long long)config.nx * config.ny * ns * 2;
+			arg = 5;
+		}
+
+		size_t length = strlen(filename);
+		StreamFormat format = StreamFormat::TgaRle;
+		if (length >= 4 && strcmp(filename + length - 4, ".pfm") == 0)
+		{
+			format = StreamFormat::Pfm;
+		}
+		else if (argc > arg && strcmp(argv[arg], "--uncompressed") == 0)
+		{
+			format = StreamFormat::Tga;
+		}
+
+		return RenderToFile(*world, materials, config, filename, format) ? 0 : 1;
+	}
 
 	// ==================================
 	// Setup SDL
@@ -230,16 +837,39 @@ int SDL_main(int argc, char* argv[]) {
 		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Render creation for surface fail : %s\n", SDL_GetError());
 		return 1;
 	}
-	SDL_Texture* framebuffer = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, config.nx, config.ny);
+	WindowFramebuffer windowFramebuffer;
+	windowFramebuffer.create(window, renderer);
+
+	PreviewRenderer preview(*world, materials);
+	preview.start();
+	preview.request(config, false);
 
 	do {
-		renderLoop(*world, config, &image, framebuffer, true);
+		renderLoop(*world, materials, config, preview, windowFramebuffer);
 	} while (!done);
 
+	// Without ESC (which stopped it already) the last view gets rendered in full
+	preview.finish();
+	preview.newFrame();
+	if (preview.front().width() > 0)
+	{
+		preview.front().copyTo(image);
+	}
+
 	// ==================================
 
 	image.flip_vertically();
 	image.write_tga_file(("../results/scene-" + label + ".tga").c_str());
 
+	if (config.noiseTarget > 0.f)
+	{
+		printf("samples: %lld (%.1f per pixel on average, %d at most)\n", film.totalSamples(), float(film.totalSamples()) / float(nx * ny), film.maxSamples());
+
+		TGAImage heatMap(nx, ny, TGAImage::RGBA);
+		RenderSampleHeatMap(film, heatMap);
+		heatMap.flip_vertically();
+		heatMap.write_tga_file(("../results/scene-" + label + "-samples.tga").c_str());
+	}
+
 	return 0;
 }
@@ -1,44 +1,120 @@
 #pragma once
+#include <map>
+#include <vector>
 #include "ray.h"
 #include "surface.h"
 #include "utils.h"
 
-class Material
+/////////////////////////////////////////////////////////////////
+//
+// Materials are plain values kept in one flat MaterialTable.
+// Surfaces and hit records only carry a MaterialId into it, and
+// scatter dispatches on the material's type with a switch rather
+// than a virtual call. Adding a material that is already in the
+// table gives back the existing id, so any number of surfaces can
+// share a handful of entries.
+//
+/////////////////////////////////////////////////////////////////
+
+// Lets renderers sort hits by material and shade each kind in its own loop
+enum MaterialType
 {
-public:
-	virtual bool scatter(const Ray& rayIn, const hit_record& rec, Vector3& attenuation, Ray& scattered) = 0;
+	MaterialLambertian,
+	MaterialMetal,
+	MaterialTypeCount
 };
 
-class Lambertian : public Material
+struct Material
 {
-public:
-	Lambertian(Vector3 albedo) : _albedo(albedo) {}
+	MaterialType type;
+	Vector3 albedo;
 
-	virtual bool scatter(const Ray & rayIn, const hit_record & rec, Vector3 & attenuation, Ray & scattered)
+	static Material lambertian(const Vector3& albedo)
 	{
-		Vector3 target = rec.p + rec.normal + Utils::randomInUnitSphere();
-		scattered = Ray(rec.p, target - rec.p);
-		attenuation = _albedo;
-		return true;
+		Material m = { MaterialLambertian, albedo };
+		return m;
 	}
 
-private:
-	Vector3 _albedo;
+	static Material metal(const Vector3& albedo)
+	{
+		Material m = { MaterialMetal, albedo };
+		return m;
+	}
+
+	// Only so identical materials can be found in the table
+	bool operator<(const Material& m) const
+	{
+		if (type != m.type) return type < m.type;
+		if (albedo.x != m.albedo.x) return albedo.x < m.albedo.x;
+		if (albedo.y != m.albedo.y) return albedo.y < m.albedo.y;
+		return albedo.z < m.albedo.z;
+	}
 };
 
-class Metal : public Material
+class MaterialTable
 {
 public:
-	Metal(Vector3 albedo) : _albedo(albedo) {}
 
-	virtual bool scatter(const Ray & rayIn, const hit_record & rec, Vector3 & attenuation, Ray & scattered)
+	// Id of an identical material if there is one already, otherwise of a new entry
+	MaterialId add(const Material& m)
 	{
-		Vector3 reflected = rayIn.direction().normalized().reflect(rec.normal);
-		scattered = Ray(rec.p, reflected);
-		attenuation = _albedo;
-		return true;
+		std::map<Material, MaterialId>::iterator found = lookup.find(m);
+		if (found != lookup.end())
+		{
+			return found->second;
+		}
+
+		MaterialId id = MaterialId(materials.size());
+		materials.push_back(m);
+		lookup[m] = id;
+		return id;
+	}
+
+	inline const Material& operator[](MaterialId id) const { return materials[id]; }
+	inline MaterialType type(MaterialId id) const { return materials[id].type; }
+	inline int size() const { return int(materials.size()); }
+
+	inline bool scatter(const Ray& rayIn, const hit_record& rec, Vector3& attenuation, Ray& scattered, Sampler& sampler) const
+	{
+		const Material& m = materials[rec.mat];
+		switch (m.type)
+		{
+		case MaterialLambertian:
+			return scatter<MaterialLambertian>(m, rayIn, rec, attenuation, scattered, sampler);
+		case MaterialMetal:
+			return scatter<MaterialMetal>(m, rayIn, rec, attenuation, scattered, sampler);
+		default:
+			return false;
+		}
+	}
+
+	// For callers that have already sorted hits by type, e.g. the wavefront shade stages
+	template <MaterialType T>
+	static inline bool scatter(const Material& m, const Ray& rayIn, const hit_record& rec, Vector3& attenuation, Ray& scattered, Sampler& sampler)
+	{
+		switch (T)
+		{
+		case MaterialLambertian:
+		{
+			Vector3 target = rec.p + rec.normal + Utils::randomInUnitSphere(sampler);
+			scattered = Ray(rec.p, target - rec.p);
+			attenuation = m.albedo;
+			return true;
+		}
+		case MaterialMetal:
+		{
+			Vector3 reflected = rayIn.direction().normalized().reflect(rec.normal);
+			scattered = Ray(rec.p, reflected);
+			attenuation = m.albedo;
+			return true;
+		}
+		default:
+			return false;
+		}
 	}
 
 private:
-	Vector3 _albedo;
-};
\ No newline at end of file
+
+	std::vector<Material> materials;
+	std::map<Material, MaterialId> lookup;
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "vector3.h"
+#include "aabb.h"
+
+/////////////////////////////////////////////////////////////////
+//
+// Packets of coherent rays, such as the primary rays through a
+// block of pixels.
+//
+// Frustum - four planes through the rays' common origin that
+// bound every ray of a packet. Anything entirely outside one of
+// them is missed by the whole packet, which lets a BVH node or a
+// sphere be culled with one test instead of one per ray.
+//
+// RayPacket - up to 8x8 rays with a common origin. Directions are
+// kept as structure of arrays so a primitive can be tested against
+// 4 or 8 rays per instruction.
+//
+/////////////////////////////////////////////////////////////////
+
+class Frustum
+{
+public:
+
+	Frustum() : valid(false) {}
+
+	// corners are directions through the four corners of the region the rays go through,
+	// in order around it (either way round)
+	Frustum(const Vector3& origin, const Vector3 corners[4]) : valid(true)
+	{
+		Vector3 middle = corners[0] + corners[1] + corners[2] + corners[3];
+		for (int i = 0; i < 4; i++)
+		{
+			const Vector3& a = corners[i];
+			const Vector3& b = corners[(i + 1) & 3];
+			Vector3 n(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+			if (n.dot(middle) < 0.f)
+			{
+				n = -n;
+			}
+
+			n.normalize();
+			normals[i] = n;
+			offsets[i] = n.dot(origin);
+		}
+	}
+
+	inline bool isValid() const { return valid; }
+
+	inline bool outside(const Vector3& center, float radius) const
+	{
+		if (!valid)
+		{
+			return false;
+		}
+
+		for (int i = 0; i < 4; i++)
+		{
+			if (normals[i].dot(center) - offsets[i] < -radius)
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// The box is outside if even its corner furthest along a plane's normal is behind it
+	inline bool outside(const AABB& box) const
+	{
+		if (!valid)
+		{
+			return false;
+		}
+
+		for (int i = 0; i < 4; i++)
+		{
+			const Vector3& n = normals[i];
+			Vector3 furthest(n.x >= 0.f ? box.pMax.x : box.pMin.x,
+				n.y >= 0.f ? box.pMax.y : box.pMin.y,
+				n.z >= 0.f ? box.pMax.z : box.pMin.z);
+			if (n.dot(furthest) - offsets[i] < 0.f)
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+private:
+
+	Vector3 normals[4];		// pointing inwards
+	float offsets[4];
+	bool valid;
+};
+
+struct RayPacket
+{
+	static const int Width = 8;
+	static const int MaxRays = Width * Width;
+
+	RayPacket() : count(0) {}
+
+	inline void add(const Vector3& d)
+	{
+		dirX[count] = d.x;
+		dirY[count] = d.y;
+		dirZ[count] = d.z;
+		count++;
+	}
+
+	inline Vector3 direction(int i) const
+	{
+		return Vector3(dirX[i], dirY[i], dirZ[i]);
+	}
+
+	Vector3 origin;
+	Frustum frustum;	// bounds all the rays when valid, otherwise nothing gets culled
+	int count;
+	float dirX[MaxRays];
+	float dirY[MaxRays];
+	float dirZ[MaxRays];
+};
@@ -1,12 +1,24 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <type_traits>
 #include <vector>
 #include "SDL.h"
 #include "raytracer.h"
 #include "tgaimage.h"
 #include "vector3.h"
 #include "utils.h"
+#include "sphere_soa.h"
+#include "tile_scheduler.h"
+#include "frame_budget.h"
+#include "triple_buffer.h"
+#include "framebuffer.h"
+#include "film.h"
+#include "resolve.h"
 
 using namespace std;
 
@@ -38,6 +50,26 @@ Features& operator--(Features& f)
 	return f = (f == Features::Color) ? Features::Reflection : static_cast<Features>(static_cast<int>(f) - 1);
 }
 
+// The shading code below is templated on the feature level, so the checks on it are
+// constants and disabled stages compile away. This picks the instantiation once, e.g.
+//   DispatchFeatures(ENABLED_FEATURES, [&](auto level) { Render<decltype(level)::value>(...); });
+template <Features F>
+using FeatureLevel = integral_constant<Features, F>;
+
+template <class Fn>
+void DispatchFeatures(Features features, Fn fn)
+{
+	switch (features)
+	{
+	case Color: fn(FeatureLevel<Color>()); break;
+	case Ambient: fn(FeatureLevel<Ambient>()); break;
+	case Diffuse: fn(FeatureLevel<Diffuse>()); break;
+	case Specular: fn(FeatureLevel<Specular>()); break;
+	case Shadows: fn(FeatureLevel<Shadows>()); break;
+	case Reflection: fn(FeatureLevel<Reflection>()); break;
+	}
+}
+
 struct Point2
 {
 	int x;
@@ -46,6 +78,22 @@ struct Point2
 
 const Point2 ASPECT_RATIO = { 16.f, 16.f };
 const TGAColor CLEAR_COL = Colors::skyBlue;
+
+// Colours are given as TGAColors but shaded in float (HDR, 1 = full scale) and resolved to
+// 8 bits once per frame, with CANVAS_RESOLVE
+inline Vector3 FloatColor(const TGAColor& c)
+{
+	return Vector3(float(c[2]), float(c[1]), float(c[0])) * (1.f / 255.f);
+}
+
+const Vector3 CLEAR_COLOR = FloatColor(CLEAR_COL);
+
+// A colour lit with intensity, which saturates at 1 as it did when colours were 8 bit
+inline Vector3 LitColor(const Vector3& color, float intensity)
+{
+	return color * fminf(fmaxf(intensity, 0.f), 1.f);
+}
+const ResolveSettings CANVAS_RESOLVE = { 1.f, Tonemap::Clamp, Gamma::Linear, true };
 const int CANVAS_WIDTH = 960;
 const int CANVAS_HEIGHT = (CANVAS_WIDTH / ASPECT_RATIO.x) * ASPECT_RATIO.y;
 const int VIEWPORT_WIDTH = 1;
@@ -53,6 +101,11 @@ const int VIEWPORT_HEIGHT = 1;
 const int VIEWPORT_DEPTH = 1;
 const float EPSILON = .0001f;
 
+// While things move the window renders at up to 1/MAX_CANVAS_SCALE of the canvas resolution,
+// as low as it needs to, to keep frames to FRAME_BUDGET_SECONDS
+const int MAX_CANVAS_SCALE = 4;
+const float FRAME_BUDGET_SECONDS = 1.f / 30.f;
+
 // TODO: these all in world space for sphere texturing
 const Vector3 UP(0.f, 1.f, 0.f);
 const Vector3 FORWARD(0.f, 0.f, -1.f);
@@ -68,7 +121,7 @@ public:
 		radius(radius),
 		specularExp(specularExp),
 		reflective(reflective),
-		color(color),
+		color(FloatColor(color)),
 		textureDetails(textureDetails)
 	{
 		rSqrd = powf(radius, 2.f);
@@ -83,7 +136,7 @@ public:
 	float rSqrd;
 
 
-	TGAColor getColorAtPoint(const Vector3& point) const
+	Vector3 getColorAtPoint(const Vector3& point) const
 	{
 		if (textureDetails)
 		{
@@ -101,15 +154,14 @@ public:
 
 			bool setCol = uv2 % 2 == 0 ? uv1 % 2 != 0 : uv1 % 2 == 0;
 
-			TGAColor texcol = uv1 % 2 != 0 ? Colors::white : Colors::black;
-			return texcol;
+			return uv1 % 2 != 0 ? Vector3(1.f) : Vector3(0.f);
 		}
 
 		return color;
 	}
 
 private:
-	TGAColor color;
+	Vector3 color;
 };
 
 struct Ray
@@ -164,7 +216,7 @@ struct Light
 struct IntersectionResult
 {
 	const Sphere * sphere;
-	TGAColor intersectionColor;
+	Vector3 intersectionColor;
 
 	// TODO: store these together
 	Vector3 intersectionPoint;
@@ -177,32 +229,71 @@ struct Scene
 	vector<Light> lights;
 	int reflectionBounces;
 	TimeUtils utils;
-};
-
 
-bool RaySphereIntersection(const TimeUtils& utils, const Ray& ray, const Sphere& sphere, std::pair<float, float>& resultOut)
-{
-	Vector3 OC = (ray.origin - sphere.centre);
-	Vector3 D = (ray.direction);
+	// Sphere geometry packed for SIMD intersection, same order as spheres
+	SphereSoA packedSpheres;
 
-	float k2 = 2.f * (OC.dot(D));
-	float k3 = (OC.dot(OC)) - sphere.rSqrd;
+	// Call after changing spheres
+	void packSpheres()
+	{
+		packedSpheres.clear();
+		for (auto iter = spheres.begin(); iter != spheres.end(); ++iter)
+		{
+			packedSpheres.add(iter->centre, iter->radius);
+		}
+	}
 
-	float discriminant = (powf(k2, 2.f) - (4 * ray.k1 * k3));
-	if (discriminant < 0)
+	// Whether anything is in the way between tMin and tMax along the ray. Only answers yes or
+	// no, so it stops at the first sphere found and works out nothing about the hit.
+	// For a shadow ray towards lights[light], the sphere that last blocked that light is tried
+	// first: neighbouring pixels are usually shadowed by the same sphere. The cache is per
+	// thread, so tiles rendering at the same time don't share (or fight over) it.
+	bool occluded(const Vector3& origin, const Vector3& direction, float tMin, float tMax, int light = -1) const
 	{
+		static thread_local vector<int> lastOccluder;
+		if (light < 0)
+		{
+			return packedSpheres.anyHit(origin, direction, tMin, tMax) >= 0;
+		}
+
+		if (light >= int(lastOccluder.size()))
+		{
+			lastOccluder.resize(light + 1, -1);
+		}
+
+		int cached = lastOccluder[light];
+		if (cached >= 0 && cached < packedSpheres.size() && packedSpheres.hits(cached, origin, direction, tMin, tMax))
+		{
+			return true;
+		}
+
+		int occluder = packedSpheres.anyHit(origin, direction, tMin, tMax);
+		if (occluder >= 0)
+		{
+			lastOccluder[light] = occluder;
+			return true;
+		}
+
 		return false;
 	}
+};
 
-	float discriminantRoot = sqrtf(discriminant);
-	float divisor = 2.f * ray.k1;
-	resultOut.first = (-k2 + discriminantRoot) / divisor;
-	resultOut.second = (-k2 - discriminantRoot) / divisor;
 
-	return true;
+// Images can be rendered at 1/scale of the canvas resolution, for speed. This is where the centre
+// of their pixel (or row) p is on the canvas.
+inline float ScaledToCanvas(int p, int scale)
+{
+	return float(p * scale) + (scale - 1) * .5f;
 }
 
-const Vector3 CanvasToViewport(int x, int y)
+// How much smaller than the canvas image is
+inline int CanvasScale(const Film& film)
+{
+	return CANVAS_WIDTH / film.width();
+}
+
+// Takes floats so the edges of pixels (for packet frustums) can be mapped too
+const Vector3 CanvasToViewport(float x, float y)
 {
 	Vector3 viewport(x * ((float)VIEWPORT_WIDTH / (float)CANVAS_WIDTH),
 		y * ((float)VIEWPORT_HEIGHT / (float)CANVAS_HEIGHT),
@@ -213,28 +304,13 @@ const Vector3 CanvasToViewport(int x, int y)
 
 bool DoesIntersectSphere(const Scene& scene, Ray& shootRay, IntersectionResult& result, float minT = 0.f, float maxT = numeric_limits<float>::max(), bool checkAll = true)
 {
-	const Sphere * firstSphere = nullptr;
-	pair<float, float> solution;
+	// Without checkAll we stop at the first sphere in the way (lowest index), these spheres aren't transparent
 	float t = maxT;
+	int index = checkAll ?
+		scene.packedSpheres.closestHit(shootRay.origin, shootRay.direction, minT, maxT, t) :
+		scene.packedSpheres.firstHit(shootRay.origin, shootRay.direction, minT, maxT, t);
 
-	for (auto iter = scene.spheres.begin(); iter != scene.spheres.end(); ++iter)
-	{
-		if (RaySphereIntersection(scene.utils, shootRay, *iter, solution))
-		{
-			float first = min(solution.first, solution.second);
-			if (first >= minT && first < t)
-			{
-				// just break here, these spheres aren't transparent
-				t = first;
-				firstSphere = &(*iter);
-
-				if (!checkAll)
-				{
-					break;
-				}
-			}
-		}
-	}
+	const Sphere * firstSphere = index >= 0 ? &scene.spheres[index] : nullptr;
 
 	result.sphere = firstSphere;
 	result.intersectionPoint = shootRay.origin + shootRay.direction * t;
@@ -258,13 +334,14 @@ float GetSpecular(const Vector3& normalN, const Vector3& lightN, const Vector3&
 	return powf(RDotV, specularPower);
 }
 
+template <Features F>
 float GetLighting(const Vector3& normalN, const Vector3& viewVecN, const Vector3& lightDirN, float intensity, float specularExp)
 {
-	float amount = ENABLED_FEATURES >= Diffuse ?
+	float amount = F >= Diffuse ?
 		GetDiffuse(normalN, lightDirN) :
 		0.f;
 
-	if (ENABLED_FEATURES >= Specular)
+	if (F >= Specular)
 	{
 		Vector3 reflectingVecN = ((normalN * 2.f) * (normalN.dot(lightDirN)) - lightDirN).normalized();
 		float specularIntensity = GetSpecular(normalN, lightDirN, viewVecN, specularExp);
@@ -274,61 +351,62 @@ float GetLighting(const Vector3& normalN, const Vector3& viewVecN, const Vector3
 	return amount * intensity;
 }
 
-// TODO: anything intersection related together, specular in material
-float LightingForRaycast(const Scene& scene, const Vector3& intersectionPoint, const Vector3& intersectionNormalN, const Vector3& viewVecN, float specular)
+// What scene.lights[light] adds to the lighting at a point: 0 when it is shadowed
+template <Features F>
+float LightContribution(const Scene& scene, int light, const Vector3& intersectionPoint, const Vector3& intersectionNormalN, const Vector3& viewVecN, float specular)
 {
-	float sceneLight = 0.f;
-	//const Vector3& intersection = result.interectionPoint;
-	//Vector3 sphereNormal = (intersection - result.sphere->centre).normalized();
-
-	for (auto iter = scene.lights.begin();
-		iter != scene.lights.end(); ++iter)
+	const Light& l = scene.lights[light];
+	switch (l.type)
+	{
+	case LightType::AmbientLight:
+		return F >= Ambient ? l.intensity : 0.f;
+	case LightType::DirectionLight:
 	{
-		float lightContribution = 0.f;
+		const Vector3& lightDir = l.directionN;
 
-		switch (iter->type)
+		// If nothing blocking us then not in shadow
+		if (F >= Shadows ?
+			!scene.occluded(intersectionPoint, lightDir, EPSILON, numeric_limits<float>::max(), light) :
+			true)
 		{
-		case LightType::AmbientLight:
-			sceneLight += ENABLED_FEATURES >= Ambient ? iter->intensity : 0.f;
-			break;
-		case LightType::DirectionLight:
-		{
-			IntersectionResult shadowIntersection;
-			const Vector3& lightDir = iter->directionN;
-			Ray shadowRay = { intersectionPoint, lightDir };
-
-			// If nothing blocking us then not in shadow
-			if (ENABLED_FEATURES >= Shadows ?
-				!DoesIntersectSphere(scene, shadowRay, shadowIntersection, EPSILON, numeric_limits<float>::max(), false) :
-				true)
-			{
-				lightContribution = GetLighting(intersectionNormalN, viewVecN, lightDir, iter->intensity, specular);
-			}
-
-			break;
+			return GetLighting<F>(intersectionNormalN, viewVecN, lightDir, l.intensity, specular);
 		}
-		case LightType::PointLight:
-
-			IntersectionResult shadowIntersection;
-			Vector3 lightDir = (iter->position - intersectionPoint);
-			Ray shadowRay = { intersectionPoint, lightDir };
+		break;
+	}
+	case LightType::PointLight:
+	{
+		Vector3 lightDir = (l.position - intersectionPoint);
 
-			// If nothing blocking us then not in shadow
-			if (ENABLED_FEATURES >= Shadows ?
-				!DoesIntersectSphere(scene, shadowRay, shadowIntersection, EPSILON, 1.f, false) :
-				true)
-			{
-				lightContribution = GetLighting(intersectionNormalN, viewVecN, lightDir.normalized(), iter->intensity, specular);
-			}
-			break;
+		// If nothing blocking us then not in shadow
+		if (F >= Shadows ?
+			!scene.occluded(intersectionPoint, lightDir, EPSILON, 1.f, light) :
+			true)
+		{
+			return GetLighting<F>(intersectionNormalN, viewVecN, lightDir.normalized(), l.intensity, specular);
 		}
+		break;
+	}
+	default:
+		break;
+	}
+
+	return 0.f;
+}
 
-		sceneLight += lightContribution;
+// TODO: anything intersection related together, specular in material
+template <Features F>
+float LightingForRaycast(const Scene& scene, const Vector3& intersectionPoint, const Vector3& intersectionNormalN, const Vector3& viewVecN, float specular)
+{
+	float sceneLight = 0.f;
+	for (int light = 0; light < int(scene.lights.size()); ++light)
+	{
+		sceneLight += LightContribution<F>(scene, light, intersectionPoint, intersectionNormalN, viewVecN, specular);
 	}
 
 	return sceneLight;
 }
 
+template <Features F>
 bool TraceRay(const Scene& scene, const Point2& canvasPosition, Ray& shootRay, IntersectionResult& result)
 {
 	Vector3 vpPos = CanvasToViewport(canvasPosition.x, canvasPosition.y);
@@ -339,13 +417,13 @@ bool TraceRay(const Scene& scene, const Point2& canvasPosition, Ray& shootRay, I
 	{
 		Vector3 sphereNormal = (result.intersectionPoint - result.sphere->centre).normalized();
 
-		float intensity = ENABLED_FEATURES > Color ?
+		float intensity = F > Color ?
 			/*LightingForRaycast(scene, result, -shootRay.direction.normalized()) :*/
-			LightingForRaycast(scene, result.intersectionPoint, sphereNormal, -shootRay.direction.normalized(), result.sphere->specularExp) :
+			LightingForRaycast<F>(scene, result.intersectionPoint, sphereNormal, -shootRay.direction.normalized(), result.sphere->specularExp) :
 			1.f;
 
 		// Now set the intersection colour
-		result.intersectionColor = result.sphere->getColorAtPoint(result.intersectionPoint) * intensity;
+		result.intersectionColor = LitColor(result.sphere->getColorAtPoint(result.intersectionPoint), intensity);
 
 		return true;
 	}
@@ -353,102 +431,630 @@ bool TraceRay(const Scene& scene, const Point2& canvasPosition, Ray& shootRay, I
 	return false;
 }
 
-bool TraceRayRec(const Scene& scene, Ray& shootRay, IntersectionResult& result, int numBouncesLeft = 0, float minT = 1.f)
+template <Features F>
+bool TraceRayRec(const Scene& scene, Ray& shootRay, IntersectionResult& result, int numBouncesLeft = 0, float minT = 1.f);
+
+// Lighting and reflections for a ray whose hit is already in result
+template <Features F>
+void ShadeIntersection(const Scene& scene, Ray& shootRay, IntersectionResult& result, int numBouncesLeft)
+{
+	Vector3 sphereNormal = (result.intersectionPoint - result.sphere->centre).normalized();
+
+	float intensity = F > Color ?
+		LightingForRaycast<F>(scene, result.intersectionPoint, sphereNormal, -shootRay.direction.normalized(), result.sphere->specularExp) :
+		1.f;
+
+	Vector3 intersectionColourCurr = LitColor(result.sphere->getColorAtPoint(result.intersectionPoint), intensity);
+	if (numBouncesLeft > 0)
+	{
+		IntersectionResult reflectResult;
+		shootRay.origin = result.intersectionPoint;
+		shootRay.direction = shootRay.direction.reflect(sphereNormal);
+		shootRay.k1 = shootRay.direction.dot(shootRay.direction);
+
+		Vector3 intersectionColourNext = CLEAR_COLOR;
+		float lerpFactor = result.sphere->reflective;
+		if ((lerpFactor > EPSILON) && TraceRayRec<F>(scene, shootRay, reflectResult, numBouncesLeft - 1, EPSILON))
+		{
+			intersectionColourNext = LitColor(reflectResult.sphere->getColorAtPoint(result.intersectionPoint), intensity);
+		}
+
+		result.intersectionColor = Vector3::lerp(intersectionColourCurr, intersectionColourNext, lerpFactor);
+	}
+	else
+	{
+		result.intersectionColor = intersectionColourCurr;
+	}
+}
+
+template <Features F>
+bool TraceRayRec(const Scene& scene, Ray& shootRay, IntersectionResult& result, int numBouncesLeft, float minT)
 {
 	if (DoesIntersectSphere(scene, shootRay, result, minT))
 	{
-		Vector3 sphereNormal = (result.intersectionPoint - result.sphere->centre).normalized();
+		ShadeIntersection<F>(scene, shootRay, result, numBouncesLeft);
+		return true;
+	}
 
-		float intensity = ENABLED_FEATURES > Color ?
-			LightingForRaycast(scene, result.intersectionPoint, sphereNormal, -shootRay.direction.normalized(), result.sphere->specularExp) :
-			1.f;
+	return false;
+}
+
+// Primary rays for a block of up to 8x8 pixels are traced as one packet: spheres outside the
+// block's frustum are dropped once for all of them, and the rest are tested against 4/8 rays at a time.
+// Ray r of the packet is pixel (x0 + r / (y1 - y0), y1 - 1 - r % (y1 - y0)) of an image at 1/scale of the canvas.
+void TracePrimaryPacket(const Scene& scene, int scale, int x0, int y0, int x1, int y1, RayPacket& packet, float* t, int* hitIndex)
+{
+	packet.origin = Vector3(VIEWPORT_WIDTH / 2.f, VIEWPORT_HEIGHT / 2.f, 0.f);
+	for (auto x = x0; x < x1; ++x)
+	{
+		for (auto y = y1 - 1; y >= y0; --y)
+		{
+			Vector3 vpPos = CanvasToViewport(ScaledToCanvas(x, scale), CANVAS_HEIGHT - ScaledToCanvas(y, scale));
+			packet.add((vpPos - packet.origin).normalized());
+		}
+	}
+
+	// Half a pixel out from the outermost rays, so the frustum bounds them with room to spare
+	float left = x0 * scale - .5f, right = x1 * scale - .5f;
+	float bottom = CANVAS_HEIGHT - y1 * scale + .5f, top = CANVAS_HEIGHT - y0 * scale + .5f;
+	Vector3 corners[4] = {
+		CanvasToViewport(left, bottom) - packet.origin,
+		CanvasToViewport(right, bottom) - packet.origin,
+		CanvasToViewport(right, top) - packet.origin,
+		CanvasToViewport(left, top) - packet.origin
+	};
+	packet.frustum = Frustum(packet.origin, corners);
 
-		TGAColor intersectionColourCurr = result.sphere->getColorAtPoint(result.intersectionPoint) * intensity;
-		if (numBouncesLeft > 0)
+	const SphereSoA& spheres = scene.packedSpheres;
+	int candidates[RayPacket::MaxRays];
+	vector<int> moreCandidates;
+	int* survivors = candidates;
+	if (spheres.size() > RayPacket::MaxRays)
+	{
+		moreCandidates.resize(spheres.size());
+		survivors = moreCandidates.data();
+	}
+
+	int numSurvivors = 0;
+	for (int i = 0; i < spheres.size(); i++)
+	{
+		Vector3 centre(spheres.centerX[i], spheres.centerY[i], spheres.centerZ[i]);
+		if (!packet.frustum.outside(centre, spheres.radius[i]))
 		{
-			IntersectionResult reflectResult;
-			shootRay.origin = result.intersectionPoint;
-			shootRay.direction = shootRay.direction.reflect(sphereNormal);
-			shootRay.k1 = shootRay.direction.dot(shootRay.direction);
-
-			TGAColor intersectionColourNext = CLEAR_COL;
-			float lerpFactor = result.sphere->reflective;
-			if ((lerpFactor > EPSILON) && TraceRayRec(scene, shootRay, reflectResult, numBouncesLeft - 1, EPSILON))
+			survivors[numSurvivors++] = i;
+		}
+	}
+
+	spheres.closestHitPacket(packet, survivors, numSurvivors, 1.f, numeric_limits<float>::max(), t, hitIndex);
+}
+
+template <Features F>
+void RenderScenePacket(const Scene& scene, Film& film, int x0, int y0, int x1, int y1)
+{
+	RayPacket packet;
+	float t[RayPacket::MaxRays];
+	int hitIndex[RayPacket::MaxRays];
+	TracePrimaryPacket(scene, CanvasScale(film), x0, y0, x1, y1, packet, t, hitIndex);
+
+	IntersectionResult result;
+	int r = 0;
+	for (auto x = x0; x < x1; ++x)
+	{
+		for (auto y = y1 - 1; y >= y0; --y, ++r)
+		{
+			if (hitIndex[r] < 0)
 			{
-				intersectionColourNext = reflectResult.sphere->getColorAtPoint(result.intersectionPoint) * intensity;
+				film.set(x, y, CLEAR_COLOR);
+				continue;
 			}
 
-			TGAColor mixed;
-			TGAColor::lerp(intersectionColourNext, intersectionColourCurr, lerpFactor, &mixed);
-			result.intersectionColor = mixed;
+			Ray testRay = { packet.origin, packet.direction(r) };
+			testRay.k1 = testRay.direction.dot(testRay.direction);
+			result.sphere = &scene.spheres[hitIndex[r]];
+			result.intersectionPoint = testRay.origin + testRay.direction * t[r];
+
+			ShadeIntersection<F>(scene, testRay, result, F >= Reflection ? 3 : 0);
+			film.set(x, y, result.intersectionColor);
 		}
-		else
+	}
+}
+
+template <Features F>
+void RenderSceneTile(const Scene& scene, Film& film, const Tile& tile)
+{
+	for (auto x = tile.x0; x < tile.x1; x += RayPacket::Width)
+	{
+		for (auto y = tile.y0; y < tile.y1; y += RayPacket::Width)
 		{
-			result.intersectionColor = intersectionColourCurr;
+			RenderScenePacket<F>(scene, film, x, y, min(x + RayPacket::Width, tile.x1), min(y + RayPacket::Width, tile.y1));
 		}
-
-		return true;
 	}
+}
 
-	return false;
+// film is the canvas, or the canvas at 1/2, 1/3 ... of its resolution; it gets one sample per
+// pixel, to be resolved for display.
+// Setting cancel (from another thread) stops the frame after the tiles in progress; returns
+// false if it did, and the film is then only partly drawn.
+bool RenderScene(const Scene& scene, Film& film, Features features = ENABLED_FEATURES, const atomic<bool>* cancel = nullptr)
+{
+	DispatchFeatures(features, [&](auto level) {
+		TileScheduler::shared().run(film.width(), film.height(), [&](const Tile& tile) {
+			if (cancel && *cancel)
+			{
+				return;
+			}
+			RenderSceneTile<decltype(level)::value>(scene, film, tile);
+		});
+	});
+
+	//image.flip_vertically();
+	return !(cancel && *cancel);
 }
 
-void RenderScene(const Scene& scene, TGAImage& image)
+/////////////////////////////////////////////////////////////////
+//
+// Per pixel cache of everything about a frame that doesn't depend
+// on the lights, for previews where only lights move.
+//
+// The first frame traces the primary and reflection rays as usual
+// and keeps the hits. After that a frame only redoes the lighting
+// (and shadow rays) of the lights that changed since the last one;
+// the other lights' terms are kept per pixel too, and are summed
+// in the same order as LightingForRaycast so the image comes out
+// the same as RenderScene's.
+//
+// Only the sphere seen in the first reflection reaches the pixel
+// (ShadeIntersection doesn't use the shading of deeper bounces),
+// so that is all of the reflection chain kept.
+//
+// Call invalidate() after moving spheres or the camera.
+//
+/////////////////////////////////////////////////////////////////
+
+class GBuffer
 {
-	// Useful variables
-	Vector3 zeroVec = { 0.f, 0.f, 0.f };
+public:
+	GBuffer() : valid(false), lastRebuilt(false) {}
 
-	Ray testRay = { { VIEWPORT_WIDTH / 2.f, VIEWPORT_HEIGHT / 2.f, 0.f }, zeroVec };
-	std::pair<float, float> intersectResult;
+	void invalidate()
+	{
+		valid = false;
+	}
 
-	IntersectionResult result;
-	for (auto x = 0; x < CANVAS_WIDTH; ++x)
+	// Whether the last frame drawn traced the hits again (the first one, or after a change of
+	// size, features or lights) rather than only shading them
+	bool rebuilt() const
 	{
-		for (auto y = CANVAS_HEIGHT - 1; y >= 0; --y)
+		return lastRebuilt;
+	}
+
+	// Returns whether it drew a frame into film: not if nothing changed since the last one
+	// (which film may still hold), nor if cancelled, as for RenderScene
+	bool render(const Scene& scene, Film& film, Features features = ENABLED_FEATURES, const atomic<bool>* cancel = nullptr)
+	{
+		bool drawn = false;
+		DispatchFeatures(features, [&](auto level) {
+			drawn = render<decltype(level)::value>(scene, film, cancel);
+		});
+		return drawn;
+	}
+
+	template <Features F>
+	bool render(const Scene& scene, Film& film, const atomic<bool>* cancel = nullptr)
+	{
+		int numLights = int(scene.lights.size());
+		bool rebuild = !valid || features != F || numLightsCached != numLights ||
+			width != film.width() || height != film.height();
+
+		dirtyLights.clear();
+		for (int light = 0; light < numLights; ++light)
+		{
+			if (rebuild || !sameLight(scene.lights[light], lights[light]))
+			{
+				dirtyLights.push_back(light);
+			}
+		}
+
+		if (!rebuild && (F == Color || dirtyLights.empty()))
 		{
-			int invY = CANVAS_HEIGHT - y;
+			// Nothing the image depends on changed
+			return false;
+		}
 
-			Vector3 vpPos = CanvasToViewport(x, invY);
+		if (rebuild)
+		{
+			width = film.width();
+			height = film.height();
+			features = F;
+			numLightsCached = numLights;
+			texels.resize(size_t(width) * height);
+			lightTerms.resize(size_t(width) * height * numLights);
+		}
 
-			Ray testRay = { { VIEWPORT_WIDTH / 2.f, VIEWPORT_HEIGHT / 2.f, 0.f }, zeroVec };
-			testRay.direction = (vpPos - testRay.origin).normalized();
-			testRay.k1 = testRay.direction.dot(testRay.direction);
+		TileScheduler::shared().run(width, height, [&](const Tile& tile) {
+			if (cancel && *cancel)
+			{
+				return;
+			}
+			if (rebuild)
+			{
+				traceTile<F>(scene, tile);
+			}
+			shadeTile<F>(scene, film, tile);
+		});
+
+		if (cancel && *cancel)
+		{
+			// Some tiles are from this frame and some from the last
+			valid = false;
+			return false;
+		}
+
+		lights = scene.lights;
+		valid = true;
+		lastRebuilt = rebuild;
+		return true;
+	}
+
+private:
+	struct Texel
+	{
+		int sphere;					// -1 for a miss
+		int reflectedSphere;		// -1 if the reflection hits nothing (or isn't traced)
+		Vector3 point;
+		Vector3 normalN;
+		Vector3 viewN;
+		Vector3 color;				// of sphere at point
+		Vector3 reflectedColor;		// of reflectedSphere at point, as ShadeIntersection takes it
+	};
 
-			if ((TraceRayRec(scene, testRay, result, ENABLED_FEATURES >= Reflection ? 3 : 0)))
+	static bool sameLight(const Light& a, const Light& b)
+	{
+		return a.type == b.type && a.position == b.position && a.directionN == b.directionN &&
+			a.intensity == b.intensity && a.spotlightAngle == b.spotlightAngle && a.range == b.range &&
+			memcmp(a.color.bgra, b.color.bgra, sizeof(a.color.bgra)) == 0;
+	}
+
+	// The primary and reflection hits of a tile, as RenderScenePacket and ShadeIntersection find them
+	template <Features F>
+	void traceTile(const Scene& scene, const Tile& tile)
+	{
+		int scale = CANVAS_WIDTH / width;
+		for (auto px = tile.x0; px < tile.x1; px += RayPacket::Width)
+		{
+			for (auto py = tile.y0; py < tile.y1; py += RayPacket::Width)
 			{
-				image.set(x, y, result.intersectionColor);
+				int x0 = px, y0 = py, x1 = min(px + RayPacket::Width, tile.x1), y1 = min(py + RayPacket::Width, tile.y1);
+
+				RayPacket packet;
+				float t[RayPacket::MaxRays];
+				int hitIndex[RayPacket::MaxRays];
+				TracePrimaryPacket(scene, scale, x0, y0, x1, y1, packet, t, hitIndex);
+
+				int r = 0;
+				for (auto x = x0; x < x1; ++x)
+				{
+					for (auto y = y1 - 1; y >= y0; --y, ++r)
+					{
+						Texel& texel = texels[y * width + x];
+						texel.sphere = hitIndex[r];
+						texel.reflectedSphere = -1;
+						if (hitIndex[r] < 0)
+						{
+							continue;
+						}
+
+						const Sphere& sphere = scene.spheres[hitIndex[r]];
+						Vector3 direction = packet.direction(r);
+						texel.point = packet.origin + direction * t[r];
+						texel.normalN = (texel.point - sphere.centre).normalized();
+						texel.viewN = -direction.normalized();
+						texel.color = sphere.getColorAtPoint(texel.point);
+
+						if (F >= Reflection && sphere.reflective > EPSILON)
+						{
+							float reflectedT;
+							Vector3 reflectedDir = direction.reflect(texel.normalN);
+							texel.reflectedSphere = scene.packedSpheres.closestHit(texel.point, reflectedDir, EPSILON, numeric_limits<float>::max(), reflectedT);
+							if (texel.reflectedSphere >= 0)
+							{
+								texel.reflectedColor = scene.spheres[texel.reflectedSphere].getColorAtPoint(texel.point);
+							}
+						}
+					}
+				}
 			}
-			else
+		}
+	}
+
+	// Relights a tile from its cached hits, redoing only the dirty lights' terms
+	template <Features F>
+	void shadeTile(const Scene& scene, Film& film, const Tile& tile)
+	{
+		int numLights = numLightsCached;
+		for (auto y = tile.y0; y < tile.y1; ++y)
+		{
+			for (auto x = tile.x0; x < tile.x1; ++x)
 			{
-				image.set(x, y, CLEAR_COL);
+				const Texel& texel = texels[y * width + x];
+				if (texel.sphere < 0)
+				{
+					film.set(x, y, CLEAR_COLOR);
+					continue;
+				}
+
+				const Sphere& sphere = scene.spheres[texel.sphere];
+				float intensity = 1.f;
+				if (F > Color)
+				{
+					float* terms = &lightTerms[(size_t(y) * width + x) * numLights];
+					for (auto iter = dirtyLights.begin(); iter != dirtyLights.end(); ++iter)
+					{
+						terms[*iter] = LightContribution<F>(scene, *iter, texel.point, texel.normalN, texel.viewN, sphere.specularExp);
+					}
+
+					intensity = 0.f;
+					for (int light = 0; light < numLights; ++light)
+					{
+						intensity += terms[light];
+					}
+				}
+
+				Vector3 color = LitColor(texel.color, intensity);
+				if (F >= Reflection)
+				{
+					Vector3 reflected = texel.reflectedSphere >= 0 ? LitColor(texel.reflectedColor, intensity) : CLEAR_COLOR;
+					color = Vector3::lerp(color, reflected, sphere.reflective);
+				}
+
+				film.set(x, y, color);
 			}
 		}
 	}
 
-	//image.flip_vertically();
-}
+	bool valid;
+	bool lastRebuilt;
+	Features features;
+	int width;
+	int height;
+	int numLightsCached;
+	vector<Texel> texels;
+	vector<float> lightTerms;		// per pixel, one per light
+	vector<Light> lights;			// as of the last frame
+	vector<int> dirtyLights;
+};
 
 // SDL
 SDL_Window *window;
 SDL_Renderer *renderer;
 int done;
-float lastTime;
+bool sunPaused;		// SPACE stops and starts the sun
 
 // Extras
 const Light SUN(Vector3(12, 1, 0), PointLight, .6f);
 
-void
-loop(const Scene& scene, TGAImage * image, SDL_Texture* framebuffer, bool renderEachFrame = true)
+// A finished frame: the canvas at 1/scale of its resolution
+struct CanvasFrame
+{
+	CanvasFrame() : scale(0) {}
+
+	Framebuffer image;
+	int scale;
+};
+
+/////////////////////////////////////////////////////////////////
+//
+// Renders frames on a thread of its own (with the tile workers
+// under it), so the SDL thread only handles input and shows
+// frames, and the window never waits for a render.
+//
+// The SDL thread hands over the scene with request(). The render
+// thread takes the newest one each time it starts a frame, renders
+// it at the resolution the frame budget allows and publishes it
+// through a triple buffer. A request for a change the user made
+// interrupts the frame in progress instead of waiting for it; so
+// does stop().
+//
+// When the scene isn't animating and the last frame was at a lower
+// resolution, the render thread goes on to render it in full.
+//
+// An animating scene only needs sending when the render thread
+// has taken the last one (wantsScene()), as each request copies
+// the whole scene.
+//
+/////////////////////////////////////////////////////////////////
+
+class RealtimeRenderer
 {
-	if (renderEachFrame)
+public:
+	RealtimeRenderer(bool cacheHits) :
+		cacheHits(cacheHits),
+		requested(0),
+		taken(0),
+		sentAnimating(false),
+		quit(false),
+		cancel(false)
+	{
+	}
+
+	~RealtimeRenderer()
+	{
+		stop();
+	}
+
+	void start()
+	{
+		thread = std::thread(&RealtimeRenderer::run, this);
+	}
+
+	// Renders a copy of scene next. interrupt drops the frame in progress.
+	void request(const Scene& scene, Features features, bool animating, bool interrupt)
 	{
-		RenderScene(scene, *image);
-		float nowSeconds = scene.utils.secondsSinceRun();
+		{
+			lock_guard<mutex> lock(jobLock);
+			pending.scene = scene;
+			pending.features = features;
+			pending.animating = animating;
+			requested++;
+			sentAnimating = animating;
+			if (interrupt)
+			{
+				cancel = true;
+			}
+		}
+		jobReady.notify_one();
+	}
 
-		cout << "FPS: " << 1.f / (nowSeconds - lastTime) << endl;
-		lastTime = nowSeconds;
+	// True once the render thread has started on the last request, so a newer scene would be
+	// rendered next rather than replace one still waiting
+	bool wantsScene() const
+	{
+		return taken == requested;
 	}
 
+	// Whether the last request was for an animating scene
+	bool animating() const
+	{
+		return sentAnimating;
+	}
+
+	// Moves front() to the newest frame; false if there is none since the last call
+	bool newFrame()
+	{
+		return frames.update();
+	}
+
+	CanvasFrame& front()
+	{
+		return frames.front();
+	}
+
+	void stop()
+	{
+		{
+			lock_guard<mutex> lock(jobLock);
+			quit = true;
+			cancel = true;
+		}
+		jobReady.notify_one();
+
+		if (thread.joinable())
+		{
+			thread.join();
+		}
+	}
+
+private:
+	struct Job
+	{
+		// Until the first request there is nothing to refine
+		Job() : features(Color), animating(true) {}
+
+		Scene scene;
+		Features features;
+		bool animating;
+	};
+
+	void run()
+	{
+		Job job;
+		long long rendered = 0;
+		int lastScale = 1;
+		Film film;
+		GBuffer gbuffer;
+		FrameBudget budget(FRAME_BUDGET_SECONDS);
+		TileChanges changes[MAX_CANVAS_SCALE];		// one per frame size
+
+		for (;;)
+		{
+			bool refine = false;
+			{
+				unique_lock<mutex> lock(jobLock);
+				jobReady.wait(lock, [&] { return quit || requested != rendered || (!job.animating && lastScale > 1); });
+				if (quit)
+				{
+					return;
+				}
+
+				if (requested != rendered)
+				{
+					job = pending;
+					rendered = requested;
+					taken = rendered;
+				}
+				else
+				{
+					refine = true;
+				}
+				cancel = false;
+			}
+
+			int scale = refine ? 1 : budget.resolutionScale(CANVAS_WIDTH, CANVAS_HEIGHT, MAX_CANVAS_SCALE);
+			CanvasFrame& frame = frames.back();
+			if (frame.scale != scale)
+			{
+				frame.image.resize(CANVAS_WIDTH / scale, CANVAS_HEIGHT / scale);
+				frame.scale = scale;
+			}
+
+			if (film.width() != frame.image.width())
+			{
+				film.resize(frame.image.width(), frame.image.height());
+			}
+
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			bool drawn = cacheHits ?
+				gbuffer.render(job.scene, film, job.features, &cancel) :
+				RenderScene(job.scene, film, job.features, &cancel);
+			if (drawn)
+			{
+				ResolveFilm(film, CANVAS_RESOLVE, frame.image);
+			}
+			float seconds = chrono::duration<float>(chrono::steady_clock::now() - start).count();
+
+			if (!drawn)
+			{
+				// Interrupted (the new request is picked up next) or nothing new to show
+				continue;
+			}
+
+			// Tracing the hits again (the first frame at a new scale) costs several frames of only
+			// shading them. Counted in, it would push the scale down for the cheap frames after it,
+			// and the next scale change would push it back up; it only counts for the frame rate.
+			bool rebuilt = cacheHits && gbuffer.rebuilt();
+			budget.frameDone(seconds, rebuilt ? 0.0 : double(frame.image.width()) * frame.image.height());
+			changes[scale - 1].update(frame.image);
+			frames.publish();
+			lastScale = scale;
+
+			if (budget.reportDue())
+			{
+				cout << "FPS: " << budget.fps() << " (1/" << scale << " resolution)" << endl;
+			}
+		}
+	}
+
+	bool cacheHits;
+	std::thread thread;
+	TripleBuffer<CanvasFrame> frames;
+
+	mutex jobLock;
+	condition_variable jobReady;
+	Job pending;
+	long long requested;
+	atomic<long long> taken;		// the last request the render thread started on
+	bool sentAnimating;				// only used by the SDL thread
+	bool quit;
+	atomic<bool> cancel;
+};
+
+// One pass of the SDL thread: handles input, passes the scene on to be rendered and shows the
+// newest frame. animating is for a scene that changed since the last pass, which is sent once
+// the render thread is ready for it; otherwise the scene is only sent after input, and the render
+// thread refines the last frame to full resolution.
+void
+loop(const Scene& scene, RealtimeRenderer& frameRenderer, WindowFramebuffer& windowFramebuffer, bool animating)
+{
 	// debugging
 	IntersectionResult result;
 
@@ -471,12 +1077,17 @@ loop(const Scene& scene, TGAImage * image, SDL_Texture* framebuffer, bool render
 			Vector3 vpPos = CanvasToViewport(x, CANVAS_HEIGHT - y);
 			Ray testRay = { { VIEWPORT_WIDTH / 2.f, VIEWPORT_HEIGHT / 2.f, 0.f },  (vpPos - testRay.origin).normalized() };
 
-			if ((TraceRayRec(scene, testRay, result, 1)))
+			bool hit = false;
+			DispatchFeatures(ENABLED_FEATURES, [&](auto level) {
+				hit = TraceRayRec<decltype(level)::value>(scene, testRay, result, 1);
+			});
+
+			if (hit)
 			{
 				//float intensity = LightingForRaycast(scene, result.interectionPoint, result.interectionNormal, -testRay.direction, result.sphere->specularExp);
 
-				TGAColor col = result.intersectionColor;
-				printf("colour: (%d, %d, %d, %d)   pH,pV: (%f, %f)\n", col.bgra[0], col.bgra[1], col.bgra[2], col.bgra[3]);
+				Vector3 col = result.intersectionColor;
+				printf("colour: (%f, %f, %f)\n", col.x, col.y, col.z);
 			}
 		}
 		else if (e.type == SDL_KEYUP)
@@ -489,6 +1100,9 @@ loop(const Scene& scene, TGAImage * image, SDL_Texture* framebuffer, bool render
 			case SDLK_DOWN:
 				--ENABLED_FEATURES;
 				break;
+			case SDLK_SPACE:
+				sunPaused = !sunPaused;
+				break;
 			case SDLK_ESCAPE:
 				done = 1;
 				return;
@@ -496,35 +1110,31 @@ loop(const Scene& scene, TGAImage * image, SDL_Texture* framebuffer, bool render
 				break;
 			}
 
-			if (!renderEachFrame)
-			{
-				dirty = true;
-			}
-
-			// render frame again if needed
-			if (dirty)
-			{
-				RenderScene(scene, *image);
-			}
+			dirty = true;
 		}
 	}
 
-	// Rendering code goes here
-	SDL_UpdateTexture(framebuffer, NULL, image->buffer(), image->get_width() * image->get_bytespp());
-
-	SDL_RenderClear(renderer);
-	SDL_RenderCopy(renderer, framebuffer, NULL, NULL);
-	SDL_RenderPresent(renderer);
+	// What the user changed shows as soon as it can, the frame in progress is dropped for it
+	// Once the scene stops it is sent again as still, for the render thread to refine
+	bool stopped = !animating && frameRenderer.animating();
+	if (dirty || stopped || (animating && frameRenderer.wantsScene()))
+	{
+		frameRenderer.request(scene, ENABLED_FEATURES, animating, dirty);
+	}
 
+	if (!frameRenderer.newFrame())
+	{
+		SDL_Delay(1);
+		return;
+	}
 
-	/* Got everything on rendering surface,
-		now Update the drawing image on window screen */
-	SDL_UpdateWindowSurface(window);
+	// Only the tiles that changed are copied, straight from the frame
+	windowFramebuffer.present(frameRenderer.front().image);
 }
 
 int RunRealTimeScene()
 {
-	TGAImage image(CANVAS_WIDTH, CANVAS_HEIGHT, TGAImage::RGBA);
+	Film film(CANVAS_WIDTH, CANVAS_HEIGHT);
 	float thresholdSqrd = powf(VIEWPORT_HEIGHT / 4.f, 2.f);
 
 	Light light(Vector3());
@@ -547,6 +1157,7 @@ int RunRealTimeScene()
 		//Sphere(Vector3({ 0, 0.1,  3 }) + viewportAdjust, 0.25f, 500.f, 0.8f, Colors::white),
 		Sphere(Vector3({ 0, -1001,  0 }) + viewportAdjust, 1000, 1000.f, 0.25f, Colors::yellow)
 	};
+	scene.packSpheres();
 	scene.reflectionBounces = 3;
 
 	Light ambient;
@@ -561,7 +1172,7 @@ int RunRealTimeScene()
 		directional
 	};
 
-	RenderScene(scene, image);
+	RenderScene(scene, film);
 
 	// Write to disk also
 	//image.flip_vertically(); // have the origin at the left bottom corner of the image
@@ -589,20 +1200,37 @@ int RunRealTimeScene()
 		return 1;
 	}
 
-	SDL_Texture* framebuffer = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, CANVAS_WIDTH, CANVAS_HEIGHT);
-	loop(scene, &image, framebuffer, true);
+	WindowFramebuffer windowFramebuffer;
+	windowFramebuffer.create(window, renderer);
+
+	// Only the sun moves below, so the hits can be kept between frames
+	bool cacheHits = true;
+	RealtimeRenderer frameRenderer(cacheHits);
+	frameRenderer.start();
+
+	loop(scene, frameRenderer, windowFramebuffer, true);
 
 	bool renderEachFrame = true;
 	if (!renderEachFrame)
 	{
-		image.write_tga_file("../results/output.tga");
+		Framebuffer image(CANVAS_WIDTH, CANVAS_HEIGHT);
+		ResolveFilm(film, CANVAS_RESOLVE, image);
+		TGAImage output;
+		image.copyTo(output);
+		output.write_tga_file("../results/output.tga");
 	}
 
+	// The sun goes round at a radian a second, and picks up where it was after a pause
+	float angle = 0.f;
+	float lastSeconds = scene.utils.secondsSinceRun();
+
 	while (!done) {
 
-		if (renderEachFrame)
+		float seconds = scene.utils.secondsSinceRun();
+		bool animating = renderEachFrame && !sunPaused;
+		if (animating)
 		{
-			float angle = -scene.utils.secondsSinceRun() * 1.0f;
+			angle -= (seconds - lastSeconds) * 1.0f;
 			//float angle = 0.f;
 
 			// rotate point
@@ -612,9 +1240,15 @@ int RunRealTimeScene()
 
 			//printf("SUN: (%f, %f, %f)\n", scene.lights[0]);
 		}
+		lastSeconds = seconds;
 
-		loop(scene, &image, framebuffer, renderEachFrame);
+		loop(scene, frameRenderer, windowFramebuffer, animating);
 	}
+
+	// Drops the frame in progress rather than wait for it
+	frameRenderer.stop();
+
+	return 0;
 }
 
 /*
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <stdint.h>
+#include "film.h"
+#include "framebuffer.h"
+#include "simd.h"
+#include "tile_scheduler.h"
+
+/////////////////////////////////////////////////////////////////
+//
+// Resolve - turns the HDR radiance a Film holds into the 8 bit
+// pixels of a Framebuffer, for the window and for TGA output.
+//
+// Per pixel: the mean of the samples, times exposure, through the
+// tonemap, gamma encoded, then quantized to 0..255 (with an ordered
+// dither, if asked for) and packed as BGRA. With SSE four pixels go
+// through at a time; the scalar version rounds the same way.
+//
+// It runs once per frame that is shown or written out, after the
+// samples are in, not once per sample.
+//
+/////////////////////////////////////////////////////////////////
+
+enum class Tonemap
+{
+	Clamp,			// to 1, per channel
+	Reinhard,		// c / (1 + c)
+	Aces			// Narkowicz's fit of the ACES filmic curve
+};
+
+enum class Gamma
+{
+	Linear,
+	Two				// square root, as the path tracer has always encoded
+};
+
+struct ResolveSettings
+{
+	float exposure;
+	Tonemap tonemap;
+	Gamma gamma;
+	bool dither;
+};
+
+// 4x4 Bayer matrix, for dither offsets of (n + 0.5) / 16
+const float ResolveDither[4][4] = {
+	{ 0.f, 8.f, 2.f, 10.f },
+	{ 12.f, 4.f, 14.f, 6.f },
+	{ 3.f, 11.f, 1.f, 9.f },
+	{ 15.f, 7.f, 13.f, 5.f }
+};
+
+namespace ResolveDetail
+{
+	inline float tonemap(float c, Tonemap tonemap)
+	{
+		switch (tonemap)
+		{
+		case Tonemap::Reinhard:
+			return c / (1.f + c);
+		case Tonemap::Aces:
+			return (c * (2.51f * c + 0.03f)) / (c * (2.43f * c + 0.59f) + 0.14f);
+		default:
+			return c;
+		}
+	}
+
+	// c is displayed units (1 = full scale); offset is the dither in [0, 1), or -1 for none
+	inline uint32_t quantize(float c, float offset)
+	{
+		float v = offset < 0.f ? 255.99f * c : 255.f * c + offset;
+		v = v > 0.f ? (v < 255.f ? v : 255.f) : 0.f;
+		return uint32_t(int(v));
+	}
+
+	inline uint32_t resolvePixel(const Film& film, const ResolveSettings& s, int x, int y)
+	{
+		int n = film.countRow(y)[x];
+		float r = 0.f, g = 0.f, b = 0.f;
+		if (n > 0)
+		{
+			float oneOver = 1.f / float(n);
+			r = film.redRow(y)[x] * oneOver * s.exposure;
+			g = film.greenRow(y)[x] * oneOver * s.exposure;
+			b = film.blueRow(y)[x] * oneOver * s.exposure;
+		}
+
+		r = tonemap(r, s.tonemap);
+		g = tonemap(g, s.tonemap);
+		b = tonemap(b, s.tonemap);
+
+		if (s.gamma == Gamma::Two)
+		{
+			r = sqrtf(fmaxf(r, 0.f));
+			g = sqrtf(fmaxf(g, 0.f));
+			b = sqrtf(fmaxf(b, 0.f));
+		}
+
+		float offset = s.dither ? (ResolveDither[y & 3][x & 3] + 0.5f) / 16.f : -1.f;
+		return 0xff000000u | quantize(r, offset) << 16 | quantize(g, offset) << 8 | quantize(b, offset);
+	}
+
+#if defined(RT_SSE)
+	inline __m128 tonemap(__m128 c, Tonemap tonemap)
+	{
+		__m128 one = _mm_set1_ps(1.f);
+		switch (tonemap)
+		{
+		case Tonemap::Reinhard:
+			return _mm_div_ps(c, _mm_add_ps(one, c));
+		case Tonemap::Aces:
+		{
+			__m128 numerator = _mm_mul_ps(c, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.51f), c), _mm_set1_ps(0.03f)));
+			__m128 denominator = _mm_add_ps(_mm_mul_ps(c, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.43f), c), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f));
+			return _mm_div_ps(numerator, denominator);
+		}
+		default:
+			return c;
+		}
+	}
+
+	// offset as for quantize, one per lane
+	inline __m128i quantize(__m128 c, __m128 scale, __m128 offset)
+	{
+		__m128 v = _mm_add_ps(_mm_mul_ps(scale, c), offset);
+		// max before min, so NaN comes out as 0 like the scalar version
+		v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(255.f));
+		return _mm_cvttps_epi32(v);
+	}
+
+	// Pixels x to x + 3 of row y
+	inline void resolve4(const Film& film, const ResolveSettings& s, int x, int y, uint32_t* out)
+	{
+		__m128 zero = _mm_setzero_ps();
+		__m128 n = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(film.countRow(y) + x)));
+		__m128 sampled = _mm_cmpgt_ps(n, zero);
+		// 1 / n, or 0 for pixels without samples (whose sums are 0) so they come out black
+		__m128 oneOver = _mm_and_ps(_mm_div_ps(_mm_set1_ps(1.f), n), sampled);
+
+		// Multiplied in the same order as resolvePixel
+		__m128 exposure = _mm_set1_ps(s.exposure);
+		__m128 r = _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(film.redRow(y) + x), oneOver), exposure);
+		__m128 g = _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(film.greenRow(y) + x), oneOver), exposure);
+		__m128 b = _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(film.blueRow(y) + x), oneOver), exposure);
+
+		r = tonemap(r, s.tonemap);
+		g = tonemap(g, s.tonemap);
+		b = tonemap(b, s.tonemap);
+
+		if (s.gamma == Gamma::Two)
+		{
+			r = _mm_sqrt_ps(_mm_max_ps(r, zero));
+			g = _mm_sqrt_ps(_mm_max_ps(g, zero));
+			b = _mm_sqrt_ps(_mm_max_ps(b, zero));
+		}
+
+		__m128 quantizeScale, offset;
+		if (s.dither)
+		{
+			const float* d = ResolveDither[y & 3];
+			quantizeScale = _mm_set1_ps(255.f);
+			offset = _mm_setr_ps((d[x & 3] + 0.5f) / 16.f, (d[(x + 1) & 3] + 0.5f) / 16.f, (d[(x + 2) & 3] + 0.5f) / 16.f, (d[(x + 3) & 3] + 0.5f) / 16.f);
+		}
+		else
+		{
+			quantizeScale = _mm_set1_ps(255.99f);
+			offset = zero;
+		}
+
+		__m128i pixels = _mm_or_si128(_mm_set1_epi32(int(0xff000000u)), _mm_slli_epi32(quantize(r, quantizeScale, offset), 16));
+		pixels = _mm_or_si128(pixels, _mm_slli_epi32(quantize(g, quantizeScale, offset), 8));
+		pixels = _mm_or_si128(pixels, quantize(b, quantizeScale, offset));
+		_mm_storeu_si128((__m128i*)out, pixels);
+	}
+#endif
+}
+
+// tile is of image, whose row 0 is the film's first row
+inline void ResolveTile(const Film& film, const ResolveSettings& settings, Framebuffer& image, const Tile& tile)
+{
+	for (int y = tile.y0; y < tile.y1; y++)
+	{
+		uint32_t* out = image.row(y);
+		int filmY = y + film.firstRow();
+		int x = tile.x0;
+#if defined(RT_SSE)
+		for (; x + 4 <= tile.x1; x += 4)
+		{
+			ResolveDetail::resolve4(film, settings, x, filmY, out + x);
+		}
+#endif
+		for (; x < tile.x1; x++)
+		{
+			out[x] = ResolveDetail::resolvePixel(film, settings, x, filmY);
+		}
+	}
+}
+
+// All of film into image (which must be its size), on the tile workers. threads is for
+// TileScheduler::shared, so call it from the thread that renders.
+inline void ResolveFilm(const Film& film, const ResolveSettings& settings, Framebuffer& image, int threads = 0)
+{
+	TileScheduler::shared(threads).run(film.width(), film.height(), [&](const Tile& tile) {
+		ResolveTile(film, settings, image, tile);
+	});
+}
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <stdint.h>
+#include "low_discrepancy.h"
+
+/////////////////////////////////////////////////////////////////
+//
+// PCG32 - permuted congruential generator (pcg32_random_r from
+// pcg-random.org). 8 bytes of state plus a stream selector, so
+// every sampler can have its own independent sequence.
+//
+/////////////////////////////////////////////////////////////////
+
+class PCG32
+{
+public:
+
+	PCG32() { seed(0x853c49e6748fea9bull, 0xda3e39cb94b95bdbull); }
+
+	PCG32(uint64_t initState, uint64_t stream) { seed(initState, stream); }
+
+	inline void seed(uint64_t initState, uint64_t stream)
+	{
+		state = 0u;
+		inc = (stream << 1u) | 1u;
+		next();
+		state += initState;
+		next();
+	}
+
+	inline uint32_t next()
+	{
+		uint64_t old = state;
+		state = old * 6364136223846793005ull + inc;
+		uint32_t xorShifted = uint32_t(((old >> 18u) ^ old) >> 27u);
+		uint32_t rot = uint32_t(old >> 59u);
+		return (xorShifted >> rot) | (xorShifted << ((0u - rot) & 31u));
+	}
+
+	// Uniform in [0, 1), using the top 24 bits so every value is exactly representable
+	inline float nextFloat()
+	{
+		return float(next() >> 8) * (1.f / 16777216.f);
+	}
+
+private:
+
+	uint64_t state;
+	uint64_t inc;
+};
+
+/////////////////////////////////////////////////////////////////
+//
+// class Sampler - hands out the sample values for one path.
+//
+// A value is addressed by (pixel, sample index, dimension). Dimensions
+// 0 and 1 jitter the camera ray, and every bounce gets its own block of
+// BounceDimensions starting at CameraDimensions + (bounce - 1) *
+// BounceDimensions, so each bounce sees the same part of the sequence
+// no matter how many values earlier bounces used. The values only
+// depend on their address and the seed, not on which thread or machine
+// renders the tile. Samplers are cheap and meant to live on the stack
+// (or in a unique_ptr) of a render thread.
+//
+// IndependentSampler is plain PCG32. The others are low discrepancy
+// and converge faster for the same number of samples:
+//   StratifiedSampler - one jittered stratum per sample in each dimension
+//   SobolSampler      - Owen scrambled Sobol, decorrelated per pixel
+//   BlueNoiseSampler  - one Sobol sequence for the image, offset per pixel
+//                       by a blue noise mask, so what error is left is
+//                       spread as high frequency noise
+//
+/////////////////////////////////////////////////////////////////
+
+enum class SamplerType
+{
+	Independent,
+	Stratified,
+	Sobol,
+	BlueNoise
+};
+
+class Sampler
+{
+public:
+
+	static const int CameraDimensions = 4;
+	static const int BounceDimensions = 4;
+
+	explicit Sampler(uint32_t seed = 0) : seedValue(seed), pixelX(0), pixelY(0), pixelKey(0), sampleIndex(0), dimension(0) {}
+
+	virtual ~Sampler() {}
+
+	// samplesPerPixel is only a hint, used to size strata. Samplers can go past it.
+	static Sampler* create(SamplerType type, uint32_t seed, int samplesPerPixel);
+
+	virtual void startPixelSample(int x, int y, int sample)
+	{
+		pixelX = x;
+		pixelY = y;
+		pixelKey = LowDiscrepancy::hashCombine(LowDiscrepancy::hashCombine(seedValue, uint32_t(x)), uint32_t(y));
+		sampleIndex = uint32_t(sample);
+		dimension = 0;
+	}
+
+	// Bounce 0 is the camera ray, bounce n is the n-th scattered ray
+	virtual void startBounce(int bounce)
+	{
+		dimension = bounce == 0 ? 0 : uint32_t(CameraDimensions + (bounce - 1) * BounceDimensions);
+	}
+
+	// Value for the next dimension of the current sample, in [0, 1)
+	virtual float get1D() = 0;
+
+	inline uint32_t seed() const { return seedValue; }
+
+protected:
+
+	uint32_t seedValue;
+	int pixelX;
+	int pixelY;
+	uint32_t pixelKey;
+	uint32_t sampleIndex;
+	uint32_t dimension;
+};
+
+class IndependentSampler : public Sampler
+{
+public:
+
+	explicit IndependentSampler(uint32_t seed) : Sampler(seed) {}
+
+	virtual void startPixelSample(int x, int y, int sample)
+	{
+		Sampler::startPixelSample(x, y, sample);
+		startBounce(0);
+	}
+
+	// Each bounce picks its own PCG stream
+	virtual void startBounce(int bounce)
+	{
+		Sampler::startBounce(bounce);
+		uint64_t key = (uint64_t(pixelKey) << 32) | sampleIndex;
+		rng.seed(key, uint64_t(bounce));
+	}
+
+	virtual float get1D()
+	{
+		dimension++;
+		return rng.nextFloat();
+	}
+
+private:
+
+	PCG32 rng;
+};
+
+class StratifiedSampler : public Sampler
+{
+public:
+
+	StratifiedSampler(uint32_t seed, int samplesPerPixel) : Sampler(seed), strata(samplesPerPixel > 0 ? uint32_t(samplesPerPixel) : 1u) {}
+
+	// Every dimension shuffles the strata differently (a Latin hypercube), so no two dimensions
+	// are correlated. Past samplesPerPixel the strata are reused with a new shuffle per round.
+	virtual float get1D()
+	{
+		uint32_t d = dimension++;
+		uint32_t round = sampleIndex / strata;
+		uint32_t key = LowDiscrepancy::hashCombine(LowDiscrepancy::hashCombine(pixelKey, d), round);
+		uint32_t stratum = LowDiscrepancy::permute(sampleIndex % strata, strata, key);
+		float jitter = LowDiscrepancy::toUnitFloat(LowDiscrepancy::hashCombine(key, sampleIndex));
+		return (float(stratum) + jitter) / float(strata);
+	}
+
+private:
+
+	uint32_t strata;
+};
+
+class SobolSampler : public Sampler
+{
+public:
+
+	explicit SobolSampler(uint32_t seed) : Sampler(seed) {}
+
+	// Dimensions are used in sets of 4 (one set per bounce), each with its own scramble
+	virtual float get1D()
+	{
+		uint32_t d = dimension++;
+		uint32_t setSeed = LowDiscrepancy::hashCombine(pixelKey, d / 4);
+		return LowDiscrepancy::toUnitFloat(LowDiscrepancy::scrambledSobol(sampleIndex, int(d % 4), setSeed));
+	}
+};
+
+class BlueNoiseSampler : public Sampler
+{
+public:
+
+	explicit BlueNoiseSampler(uint32_t seed) : Sampler(seed), mask(LowDiscrepancy::BlueNoiseMask::get()) {}
+
+	// Every pixel walks the same sequence, shifted (Cranley-Patterson rotation) by the blue noise
+	// mask. Each dimension reads the mask at a different toroidal offset.
+	virtual float get1D()
+	{
+		uint32_t d = dimension++;
+		uint32_t setSeed = LowDiscrepancy::hashCombine(seedValue, d / 4);
+		float value = LowDiscrepancy::toUnitFloat(LowDiscrepancy::scrambledSobol(sampleIndex, int(d % 4), setSeed));
+
+		uint32_t offset = LowDiscrepancy::hashCombine(seedValue ^ 0xb10e5eedu, d);
+		value += mask.at(pixelX + int(offset & 0xffu), pixelY + int(offset >> 8 & 0xffu));
+		return value < 1.f ? value : value - 1.f;
+	}
+
+private:
+
+	const LowDiscrepancy::BlueNoiseMask& mask;
+};
+
+inline Sampler* Sampler::create(SamplerType type, uint32_t seed, int samplesPerPixel)
+{
+	switch (type)
+	{
+	case SamplerType::Stratified:
+		return new StratifiedSampler(seed, samplesPerPixel);
+	case SamplerType::Sobol:
+		return new SobolSampler(seed);
+	case SamplerType::BlueNoise:
+		return new BlueNoiseSampler(seed);
+	case SamplerType::Independent:
+	default:
+		return new IndependentSampler(seed);
+	}
+}
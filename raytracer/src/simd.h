@@ -0,0 +1,18 @@
+#pragma once
+
+/////////////////////////////////////////////////////////////////
+//
+// Compile time SIMD detection. MSVC only defines __AVX__/__AVX2__
+// when building with /arch:AVX(2), and always has SSE2 on x64.
+//
+/////////////////////////////////////////////////////////////////
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RT_SSE 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX__)
+#define RT_AVX 1
+#include <immintrin.h>
+#endif
@@ -6,17 +6,11 @@
 class Sphere : public Surface {
 public:
 	Sphere() {}
-	Sphere(Vector3 cen, float r, Material * mat) : center(cen), radius(r), material(mat) {};
+	Sphere(Vector3 cen, float r, MaterialId mat) : center(cen), radius(r), material(mat) {};
 
-	virtual bool hit(const Ray& r, float tMin, float tMax, hit_record&rec) const;
-
-	virtual ~Sphere()
-	{
-		if (material != NULL)
-		{
-			delete(material);
-		}
-	}
+	virtual bool intersect(const Ray& r, float tMin, float tMax, SurfaceHit& hit) const;
+	virtual void fillHit(const Ray& r, const SurfaceHit& hit, hit_record& rec) const;
+	virtual bool boundingBox(AABB& box) const;
 
 public:
 
@@ -30,10 +24,10 @@ public:
 
 	Vector3 center;
 	float radius;
-	Material * material;
+	MaterialId material;
 };
 
-bool Sphere::hit(const Ray& r, float tMin, float tMax, hit_record&rec) const
+bool Sphere::intersect(const Ray& r, float tMin, float tMax, SurfaceHit& hit) const
 {
 	Vector3 oc = r.origin() - center;
 	float a = r.direction().dot(r.direction());
@@ -49,7 +43,9 @@ bool Sphere::hit(const Ray& r, float tMin, float tMax, hit_record&rec) const
 
 		if (t < tMax && t > tMin) 
 		{
-			setHit(r, t, rec);
+			hit.t = t;
+			hit.surface = this;
+			hit.primitive = 0;
 			return true;
 		}
 		//if (temp < tMax && temp > tMin)
@@ -60,4 +56,16 @@ bool Sphere::hit(const Ray& r, float tMin, float tMax, hit_record&rec) const
 	}
 
 	return false;
+}
+
+void Sphere::fillHit(const Ray& r, const SurfaceHit& hit, hit_record& rec) const
+{
+	setHit(r, hit.t, rec);
+}
+
+bool Sphere::boundingBox(AABB& box) const
+{
+	Vector3 extent(fabsf(radius));
+	box = AABB(center - extent, center + extent);
+	return true;
 }
\ No newline at end of file
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "cpu_features.h"
+
+/////////////////////////////////////////////////////////////////
+//
+// Ray / sphere kernels built for several instruction sets in one
+// binary.
+//
+// sphere_kernels_sse4.cpp, _avx2.cpp and _avx512.cpp each compile
+// the kernels in sphere_kernels_impl.h with their own arch flags
+// (see the project file) and hand back a table of pointers to
+// them. sphereKernels() picks the widest table the CPU supports the
+// first time it is asked.
+//
+// Those files only use the plain structs below and call no inline
+// function from the shared headers: an inline function built with
+// AVX-512 there could be the copy the linker keeps for everyone.
+//
+/////////////////////////////////////////////////////////////////
+
+// The arrays of a SphereSoA. They are padded past count to a multiple of SphereKernels::Padding.
+struct SphereArrays
+{
+	const float* centerX;
+	const float* centerY;
+	const float* centerZ;
+	const float* radius;
+	int count;
+};
+
+// The rays of a RayPacket
+struct PacketArrays
+{
+	float origin[3];
+	const float* dirX;
+	const float* dirY;
+	const float* dirZ;
+	int count;
+};
+
+struct SphereKernels
+{
+	// Widest vector the kernels load, in floats
+	static const int Padding = 16;
+
+	SimdLevel level;
+
+	// Closest sphere hit with tMin < t < tMax. Returns its index and sets tOut, or -1.
+	int (*closestHit)(const SphereArrays& spheres, const float* origin, const float* direction, float tMin, float tMax, float& tOut);
+
+	// Lowest indexed sphere hit with tMin < t < tMax
+	int (*firstHit)(const SphereArrays& spheres, const float* origin, const float* direction, float tMin, float tMax, float& tOut);
+
+	// Closest hit among the candidates (in increasing index order) for every ray of the packet.
+	// Rays that hit nothing get tMax and -1.
+	void (*closestHitPacket)(const SphereArrays& spheres, const PacketArrays& packet, const int* candidates, int numCandidates,
+		float tMin, float tMax, float* tOut, int* indexOut);
+};
+
+const SphereKernels& sphereKernelsSSE4();
+const SphereKernels& sphereKernelsAVX2();
+const SphereKernels& sphereKernelsAVX512();
+
+inline const SphereKernels& selectSphereKernels()
+{
+	switch (CpuFeatures::select())
+	{
+	case SimdLevel::AVX512: return sphereKernelsAVX512();
+	case SimdLevel::AVX2: return sphereKernelsAVX2();
+	default: return sphereKernelsSSE4();
+	}
+}
+
+inline const SphereKernels& sphereKernels()
+{
+	static const SphereKernels& kernels = selectSphereKernels();
+	return kernels;
+}
@@ -0,0 +1,13 @@
+/////////////////////////////////////////////////////////////////
+//
+// Ray / sphere kernels, 8 lanes. Built with /arch:AVX2 (-mavx2).
+//
+/////////////////////////////////////////////////////////////////
+
+#include "sphere_kernels_impl.h"
+
+const SphereKernels& sphereKernelsAVX2()
+{
+	static const SphereKernels kernels = makeSphereKernels<Lanes8>(SimdLevel::AVX2);
+	return kernels;
+}
@@ -0,0 +1,14 @@
+/////////////////////////////////////////////////////////////////
+//
+// Ray / sphere kernels, 16 lanes. Built with /arch:AVX512
+// (-mavx512f).
+//
+/////////////////////////////////////////////////////////////////
+
+#include "sphere_kernels_impl.h"
+
+const SphereKernels& sphereKernelsAVX512()
+{
+	static const SphereKernels kernels = makeSphereKernels<Lanes16>(SimdLevel::AVX512);
+	return kernels;
+}
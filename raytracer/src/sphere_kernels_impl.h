@@ -0,0 +1,448 @@
+#pragma once
+
+#include <math.h>
+#include <immintrin.h>
+#include "sphere_kernels.h"
+
+/////////////////////////////////////////////////////////////////
+//
+// The ray / sphere kernels, written once against a lane type L:
+//
+//   F, I, M       - float vector, int vector and lane mask
+//   Width         - lanes per vector
+//   Narrower      - lane type to use when there's less than Width
+//                   of work, if HasNarrower
+//   set1, load, store, add, sub, mul, div, sqrt
+//   gt, lt        - compares, giving M
+//   both          - mask and
+//   bits          - M as an int, one bit per lane
+//   select(m,a,b) - a where m is set, b elsewhere (iselect for I)
+//   iset1, iramp, iadd, ilt, istore
+//
+// Lanes4 (SSE2) always exists, Lanes8 (AVX2) and Lanes16 (AVX-512)
+// only when the including file is built for them. Each
+// sphere_kernels_<isa>.cpp makes its table from the widest.
+//
+// The arithmetic matches Sphere::hit operation for operation, so
+// every width gives the same t values as the scalar code, as long as
+// neither side has mul + add contracted into FMA. The kernels turn
+// contraction off below for GCC and clang (MSVC doesn't contract
+// unless asked to with /fp:contract); the scalar code is only safe
+// as long as its own file isn't built for FMA, or is built with
+// -ffp-contract=off.
+//
+// Everything is in an unnamed namespace, so each file gets its
+// own copy built for its own instruction set.
+//
+/////////////////////////////////////////////////////////////////
+
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+namespace
+{
+	// SSE2, which every x64 CPU has
+	struct Lanes4
+	{
+		static const int Width = 4;
+		static const bool HasNarrower = false;
+		typedef Lanes4 Narrower;
+		typedef __m128 F;
+		typedef __m128i I;
+		typedef __m128 M;
+
+		static inline F set1(float f) { return _mm_set1_ps(f); }
+		static inline F load(const float* p) { return _mm_loadu_ps(p); }
+		static inline void store(float* p, F v) { _mm_storeu_ps(p, v); }
+		static inline F add(F a, F b) { return _mm_add_ps(a, b); }
+		static inline F sub(F a, F b) { return _mm_sub_ps(a, b); }
+		static inline F mul(F a, F b) { return _mm_mul_ps(a, b); }
+		static inline F div(F a, F b) { return _mm_div_ps(a, b); }
+		static inline F sqrt(F a) { return _mm_sqrt_ps(a); }
+		static inline M gt(F a, F b) { return _mm_cmpgt_ps(a, b); }
+		static inline M lt(F a, F b) { return _mm_cmplt_ps(a, b); }
+		static inline M both(M a, M b) { return _mm_and_ps(a, b); }
+		static inline int bits(M m) { return _mm_movemask_ps(m); }
+		static inline F select(M m, F a, F b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+
+		static inline I iset1(int i) { return _mm_set1_epi32(i); }
+		static inline I iramp() { return _mm_set_epi32(3, 2, 1, 0); }
+		static inline I iadd(I a, I b) { return _mm_add_epi32(a, b); }
+		static inline M ilt(I a, I b) { return _mm_castsi128_ps(_mm_cmplt_epi32(a, b)); }
+		static inline void istore(int* p, I v) { _mm_storeu_si128((__m128i*)p, v); }
+
+		static inline I iselect(M m, I a, I b)
+		{
+			__m128i mi = _mm_castps_si128(m);
+			return _mm_or_si128(_mm_and_si128(mi, a), _mm_andnot_si128(mi, b));
+		}
+	};
+
+#if defined(__AVX2__)
+	struct Lanes8
+	{
+		static const int Width = 8;
+		static const bool HasNarrower = true;
+		typedef Lanes4 Narrower;
+		typedef __m256 F;
+		typedef __m256i I;
+		typedef __m256 M;
+
+		static inline F set1(float f) { return _mm256_set1_ps(f); }
+		static inline F load(const float* p) { return _mm256_loadu_ps(p); }
+		static inline void store(float* p, F v) { _mm256_storeu_ps(p, v); }
+		static inline F add(F a, F b) { return _mm256_add_ps(a, b); }
+		static inline F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+		static inline F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+		static inline F div(F a, F b) { return _mm256_div_ps(a, b); }
+		static inline F sqrt(F a) { return _mm256_sqrt_ps(a); }
+		static inline M gt(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+		static inline M lt(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+		static inline M both(M a, M b) { return _mm256_and_ps(a, b); }
+		static inline int bits(M m) { return _mm256_movemask_ps(m); }
+		static inline F select(M m, F a, F b) { return _mm256_blendv_ps(b, a, m); }
+
+		static inline I iset1(int i) { return _mm256_set1_epi32(i); }
+		static inline I iramp() { return _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0); }
+		static inline I iadd(I a, I b) { return _mm256_add_epi32(a, b); }
+		static inline M ilt(I a, I b) { return _mm256_castsi256_ps(_mm256_cmpgt_epi32(b, a)); }
+		static inline void istore(int* p, I v) { _mm256_storeu_si256((__m256i*)p, v); }
+		static inline I iselect(M m, I a, I b) { return _mm256_blendv_epi8(b, a, _mm256_castps_si256(m)); }
+	};
+#endif
+
+#if defined(__AVX512F__)
+	// Compares give a lane bit mask (__mmask16) rather than a vector
+	struct Lanes16
+	{
+		static const int Width = 16;
+		static const bool HasNarrower = true;
+		typedef Lanes8 Narrower;
+		typedef __m512 F;
+		typedef __m512i I;
+		typedef __mmask16 M;
+
+		static inline F set1(float f) { return _mm512_set1_ps(f); }
+		static inline F load(const float* p) { return _mm512_loadu_ps(p); }
+		static inline void store(float* p, F v) { _mm512_storeu_ps(p, v); }
+		static inline F add(F a, F b) { return _mm512_add_ps(a, b); }
+		static inline F sub(F a, F b) { return _mm512_sub_ps(a, b); }
+		static inline F mul(F a, F b) { return _mm512_mul_ps(a, b); }
+		static inline F div(F a, F b) { return _mm512_div_ps(a, b); }
+		static inline F sqrt(F a) { return _mm512_sqrt_ps(a); }
+		static inline M gt(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+		static inline M lt(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+		static inline M both(M a, M b) { return M(a & b); }
+		static inline int bits(M m) { return int(m); }
+		static inline F select(M m, F a, F b) { return _mm512_mask_blend_ps(m, b, a); }
+
+		static inline I iset1(int i) { return _mm512_set1_epi32(i); }
+		static inline I iramp() { return _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0); }
+		static inline I iadd(I a, I b) { return _mm512_add_epi32(a, b); }
+		static inline M ilt(I a, I b) { return _mm512_cmplt_epi32_mask(a, b); }
+		static inline void istore(int* p, I v) { _mm512_storeu_si512(p, v); }
+		static inline I iselect(M m, I a, I b) { return _mm512_mask_blend_epi32(m, b, a); }
+	};
+#endif
+
+	inline bool intersectScalar(const SphereArrays& s, int i, const float* o, const float* d, float& t)
+	{
+		float ocx = o[0] - s.centerX[i];
+		float ocy = o[1] - s.centerY[i];
+		float ocz = o[2] - s.centerZ[i];
+		float a = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+		float b = 2.f * (ocx * d[0] + ocy * d[1] + ocz * d[2]);
+		float c = (ocx * ocx + ocy * ocy + ocz * ocz) - s.radius[i] * s.radius[i];
+		float discriminant = b * b - 4 * a*c;
+		if (discriminant > 0)
+		{
+			t = (-b - sqrtf(discriminant)) / (2.f * a);
+			return true;
+		}
+
+		return false;
+	}
+
+	// Picks the closest lane; on equal t the lower sphere index wins, as in a linear scan
+	inline int reduceLanes(const float* laneT, const int* laneIndex, int lanes, float tMax, float& tOut)
+	{
+		int closest = -1;
+		float closestT = tMax;
+		for (int k = 0; k < lanes; k++)
+		{
+			if (laneIndex[k] < 0)
+			{
+				continue;
+			}
+
+			if (closest < 0 || laneT[k] < closestT || (laneT[k] == closestT && laneIndex[k] < closest))
+			{
+				closest = laneIndex[k];
+				closestT = laneT[k];
+			}
+		}
+
+		tOut = closestT;
+		return closest;
+	}
+
+	// Mask of the lanes [i, i + Width) that hit with tMin < t < tMax, and their t values
+	template <class L>
+	inline typename L::M intersectLanes(const SphereArrays& s, int i, typename L::F ox, typename L::F oy, typename L::F oz,
+		typename L::F dx, typename L::F dy, typename L::F dz, typename L::F fourA, typename L::F twoA,
+		typename L::F tMin, typename L::F tMax, typename L::F& t)
+	{
+		typedef typename L::F F;
+		typedef typename L::M M;
+		const F two = L::set1(2.f);
+		const F zero = L::set1(0.f);
+		F r = L::load(&s.radius[i]);
+		F ocx = L::sub(ox, L::load(&s.centerX[i]));
+		F ocy = L::sub(oy, L::load(&s.centerY[i]));
+		F ocz = L::sub(oz, L::load(&s.centerZ[i]));
+
+		F b = L::mul(two, L::add(L::add(L::mul(ocx, dx), L::mul(ocy, dy)), L::mul(ocz, dz)));
+		F c = L::sub(L::add(L::add(L::mul(ocx, ocx), L::mul(ocy, ocy)), L::mul(ocz, ocz)), L::mul(r, r));
+		F discriminant = L::sub(L::mul(b, b), L::mul(fourA, c));
+
+		M mask = L::gt(discriminant, zero);
+		t = L::div(L::sub(L::sub(zero, b), L::sqrt(discriminant)), twoA);
+		mask = L::both(mask, L::both(L::lt(t, tMax), L::gt(t, tMin)));
+
+		// Mask off lanes past the end of the arrays
+		int valid = s.count - i;
+		if (valid < L::Width)
+		{
+			mask = L::both(mask, L::ilt(L::iramp(), L::iset1(valid)));
+		}
+
+		return mask;
+	}
+
+	inline int closestHitScalar(const SphereArrays& s, const float* o, const float* d, float tMin, float tMax, float& tOut)
+	{
+		int closest = -1;
+		float t;
+		for (int i = 0; i < s.count; i++)
+		{
+			if (intersectScalar(s, i, o, d, t) && t < tMax && t > tMin)
+			{
+				tMax = t;
+				closest = i;
+			}
+		}
+
+		tOut = tMax;
+		return closest;
+	}
+
+	template <class L>
+	int closestHitLanes(const SphereArrays& s, const float* o, const float* d, float tMin, float tMax, float& tOut)
+	{
+		typedef typename L::F F;
+		typedef typename L::I I;
+		typedef typename L::M M;
+
+		float a = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+		F ox = L::set1(o[0]), oy = L::set1(o[1]), oz = L::set1(o[2]);
+		F dx = L::set1(d[0]), dy = L::set1(d[1]), dz = L::set1(d[2]);
+		F fourA = L::set1(4 * a), twoA = L::set1(2.f * a);
+		F tMinL = L::set1(tMin);
+
+		// Each lane keeps its own closest hit, and they're reduced at the end
+		F bestT = L::set1(tMax);
+		I bestIndex = L::iset1(-1);
+		I index = L::iramp();
+		const I width = L::iset1(L::Width);
+
+		for (int i = 0; i < s.count; i += L::Width)
+		{
+			F t;
+			M mask = intersectLanes<L>(s, i, ox, oy, oz, dx, dy, dz, fourA, twoA, tMinL, bestT, t);
+			bestT = L::select(mask, t, bestT);
+			bestIndex = L::iselect(mask, index, bestIndex);
+			index = L::iadd(index, width);
+		}
+
+		float laneT[L::Width];
+		int laneIndex[L::Width];
+		L::store(laneT, bestT);
+		L::istore(laneIndex, bestIndex);
+		return reduceLanes(laneT, laneIndex, L::Width, tMax, tOut);
+	}
+
+	template <class L>
+	int firstHitLanes(const SphereArrays& s, const float* o, const float* d, float tMin, float tMax, float& tOut)
+	{
+		typedef typename L::F F;
+
+		float a = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+		F ox = L::set1(o[0]), oy = L::set1(o[1]), oz = L::set1(o[2]);
+		F dx = L::set1(d[0]), dy = L::set1(d[1]), dz = L::set1(d[2]);
+		F fourA = L::set1(4 * a), twoA = L::set1(2.f * a);
+		F tMinL = L::set1(tMin), tMaxL = L::set1(tMax);
+
+		for (int i = 0; i < s.count; i += L::Width)
+		{
+			F t;
+			int bits = L::bits(intersectLanes<L>(s, i, ox, oy, oz, dx, dy, dz, fourA, twoA, tMinL, tMaxL, t));
+			if (bits != 0)
+			{
+				float laneT[L::Width];
+				L::store(laneT, t);
+				int lane = 0;
+				while ((bits & (1 << lane)) == 0)
+				{
+					lane++;
+				}
+
+				tOut = laneT[lane];
+				return i + lane;
+			}
+		}
+
+		return -1;
+	}
+
+	// Fewer spheres than lanes go to narrower vectors, down to scalar code for less than 4
+	template <class L>
+	int closestHit(const SphereArrays& s, const float* o, const float* d, float tMin, float tMax, float& tOut)
+	{
+		if (s.count >= L::Width)
+		{
+			return closestHitLanes<L>(s, o, d, tMin, tMax, tOut);
+		}
+
+		return L::HasNarrower ? closestHit<typename L::Narrower>(s, o, d, tMin, tMax, tOut) : closestHitScalar(s, o, d, tMin, tMax, tOut);
+	}
+
+	template <class L>
+	int firstHit(const SphereArrays& s, const float* o, const float* d, float tMin, float tMax, float& tOut)
+	{
+		if (L::HasNarrower && s.count < L::Width)
+		{
+			return firstHit<typename L::Narrower>(s, o, d, tMin, tMax, tOut);
+		}
+
+		return firstHitLanes<L>(s, o, d, tMin, tMax, tOut);
+	}
+
+	// Rays [first, first + Width) of the packet against each candidate in turn
+	template <class L>
+	void closestHitPacketLanes(const SphereArrays& s, const PacketArrays& p, int first, const int* candidates, int numCandidates,
+		float tMin, float tMax, float* tOut, int* indexOut)
+	{
+		typedef typename L::F F;
+		typedef typename L::I I;
+		typedef typename L::M M;
+		const F two = L::set1(2.f);
+		const F four = L::set1(4.f);
+		const F zero = L::set1(0.f);
+		F dx = L::load(&p.dirX[first]);
+		F dy = L::load(&p.dirY[first]);
+		F dz = L::load(&p.dirZ[first]);
+		F a = L::add(L::add(L::mul(dx, dx), L::mul(dy, dy)), L::mul(dz, dz));
+		F fourA = L::mul(four, a);
+		F twoA = L::mul(two, a);
+		F tMinL = L::set1(tMin);
+
+		F bestT = L::set1(tMax);
+		I bestIndex = L::iset1(-1);
+		for (int k = 0; k < numCandidates; k++)
+		{
+			// The origin is shared, so everything but b is the same for all rays
+			int i = candidates[k];
+			float ocx = p.origin[0] - s.centerX[i];
+			float ocy = p.origin[1] - s.centerY[i];
+			float ocz = p.origin[2] - s.centerZ[i];
+			float c = ocx * ocx + ocy * ocy + ocz * ocz - s.radius[i] * s.radius[i];
+
+			F b = L::mul(two, L::add(L::add(L::mul(L::set1(ocx), dx), L::mul(L::set1(ocy), dy)), L::mul(L::set1(ocz), dz)));
+			F discriminant = L::sub(L::mul(b, b), L::mul(fourA, L::set1(c)));
+
+			M mask = L::gt(discriminant, zero);
+			F t = L::div(L::sub(L::sub(zero, b), L::sqrt(discriminant)), twoA);
+			mask = L::both(mask, L::both(L::lt(t, bestT), L::gt(t, tMinL)));
+
+			bestT = L::select(mask, t, bestT);
+			bestIndex = L::iselect(mask, L::iset1(i), bestIndex);
+		}
+
+		L::store(&tOut[first], bestT);
+		L::istore(&indexOut[first], bestIndex);
+	}
+
+	template <class L>
+	void closestHitPacket(const SphereArrays& s, const PacketArrays& p, const int* candidates, int numCandidates,
+		float tMin, float tMax, float* tOut, int* indexOut)
+	{
+		int first = 0;
+		for (; first + L::Width <= p.count; first += L::Width)
+		{
+			closestHitPacketLanes<L>(s, p, first, candidates, numCandidates, tMin, tMax, tOut, indexOut);
+		}
+
+		for (int r = first; r < p.count; r++)
+		{
+			float d[3] = { p.dirX[r], p.dirY[r], p.dirZ[r] };
+			float closestT = tMax;
+			int closest = -1;
+			float t;
+			for (int k = 0; k < numCandidates; k++)
+			{
+				if (intersectScalar(s, candidates[k], p.origin, d, t) && t < closestT && t > tMin)
+				{
+					closestT = t;
+					closest = candidates[k];
+				}
+			}
+
+			tOut[r] = closestT;
+			indexOut[r] = closest;
+		}
+	}
+
+	// Built for AVX, the compiler may use the upper halves of registers even in 128 bit code
+	// (as scratch space), and doesn't always clear them before returning. The rest of the
+	// program is SSE code, which would then pay for a state transition on every instruction.
+	inline void leaveKernel()
+	{
+#if defined(__AVX__)
+		_mm256_zeroupper();
+#endif
+	}
+
+	template <class L>
+	int closestHitKernel(const SphereArrays& s, const float* o, const float* d, float tMin, float tMax, float& tOut)
+	{
+		int hit = closestHit<L>(s, o, d, tMin, tMax, tOut);
+		leaveKernel();
+		return hit;
+	}
+
+	template <class L>
+	int firstHitKernel(const SphereArrays& s, const float* o, const float* d, float tMin, float tMax, float& tOut)
+	{
+		int hit = firstHit<L>(s, o, d, tMin, tMax, tOut);
+		leaveKernel();
+		return hit;
+	}
+
+	template <class L>
+	void closestHitPacketKernel(const SphereArrays& s, const PacketArrays& p, const int* candidates, int numCandidates,
+		float tMin, float tMax, float* tOut, int* indexOut)
+	{
+		closestHitPacket<L>(s, p, candidates, numCandidates, tMin, tMax, tOut, indexOut);
+		leaveKernel();
+	}
+
+	template <class L>
+	SphereKernels makeSphereKernels(SimdLevel level)
+	{
+		SphereKernels kernels = { level, closestHitKernel<L>, firstHitKernel<L>, closestHitPacketKernel<L> };
+		return kernels;
+	}
+}
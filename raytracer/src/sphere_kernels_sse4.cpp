@@ -0,0 +1,14 @@
+/////////////////////////////////////////////////////////////////
+//
+// Ray / sphere kernels, 4 lanes. Only needs SSE2, so this is also
+// what any other x64 CPU falls back to.
+//
+/////////////////////////////////////////////////////////////////
+
+#include "sphere_kernels_impl.h"
+
+const SphereKernels& sphereKernelsSSE4()
+{
+	static const SphereKernels kernels = makeSphereKernels<Lanes4>(SimdLevel::SSE4);
+	return kernels;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+#include "surface.h"
+#include "sphere_soa.h"
+
+/////////////////////////////////////////////////////////////////
+//
+// class SpherePool - a packed set of spheres behaving as one Surface.
+//
+// Geometry lives in a SphereSoA and is tested several spheres at a
+// time; each sphere only carries its id into the MaterialTable.
+//
+/////////////////////////////////////////////////////////////////
+
+class SpherePool : public Surface {
+public:
+	SpherePool() {}
+
+	int add(const Vector3& center, float radius, MaterialId mat);
+
+	virtual bool intersect(const Ray& r, float tMin, float tMax, SurfaceHit& hit) const;
+	virtual void fillHit(const Ray& r, const SurfaceHit& hit, hit_record& rec) const;
+	virtual bool boundingBox(AABB& box) const;
+
+	inline int size() const { return spheres.size(); }
+
+public:
+
+	SphereSoA spheres;
+	std::vector<MaterialId> materialIds;
+};
+
+int SpherePool::add(const Vector3& center, float radius, MaterialId mat)
+{
+	materialIds.push_back(mat);
+	return spheres.add(center, radius);
+}
+
+bool SpherePool::intersect(const Ray& r, float tMin, float tMax, SurfaceHit& hit) const
+{
+	float t;
+	int i = spheres.closestHit(r.origin(), r.direction(), tMin, tMax, t);
+	if (i < 0)
+	{
+		return false;
+	}
+
+	hit.t = t;
+	hit.surface = this;
+	hit.primitive = i;
+	return true;
+}
+
+void SpherePool::fillHit(const Ray& r, const SurfaceHit& hit, hit_record& rec) const
+{
+	int i = hit.primitive;
+	Vector3 center(spheres.centerX[i], spheres.centerY[i], spheres.centerZ[i]);
+	rec.t = hit.t;
+	rec.p = r.pointAtParameter(hit.t);
+	rec.normal = ((rec.p - center) / spheres.radius[i]);
+	rec.mat = materialIds[i];
+}
+
+bool SpherePool::boundingBox(AABB& box) const
+{
+	box = AABB();
+	for (int i = 0; i < size(); i++)
+	{
+		Vector3 center(spheres.centerX[i], spheres.centerY[i], spheres.centerZ[i]);
+		Vector3 extent(fabsf(spheres.radius[i]));
+		box.grow(AABB(center - extent, center + extent));
+	}
+
+	return size() > 0;
+}
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <vector>
+#include <float.h>
+#include <math.h>
+#include "vector3.h"
+#include "simd.h"
+#include "ray_packet.h"
+#include "sphere_kernels.h"
+
+/////////////////////////////////////////////////////////////////
+//
+// class SphereSoA - sphere centres and radii packed in contiguous
+// structure-of-arrays form, so one ray can be tested against 4 (SSE)
+// or 8 (AVX) spheres per instruction.
+//
+// This only knows about geometry. Callers map the returned index to
+// whatever they attach to a sphere (material id, realtime sphere...).
+//
+// closestHitPacket goes the other way round, testing one sphere against
+// several rays of a packet at a time.
+//
+// With SSE the vector kernels come from sphereKernels(), built for
+// SSE4, AVX2 and AVX-512 and picked at startup for the CPU (see
+// sphere_kernels.h). The arrays are padded to a multiple of the
+// widest vector so the kernels can always load full vectors; padding
+// lanes are masked off by index. The arithmetic matches Sphere::hit
+// operation for operation, so the vector kernels return bit
+// identical t values to the scalar code, as long as neither side is
+// contracted into FMA (see sphere_kernels_impl.h).
+//
+/////////////////////////////////////////////////////////////////
+
+class SphereSoA
+{
+public:
+
+	std::vector<float> centerX;
+	std::vector<float> centerY;
+	std::vector<float> centerZ;
+	std::vector<float> radius;
+
+	static const int Padding = SphereKernels::Padding;
+
+	SphereSoA() : count(0) {}
+
+	inline int size() const { return count; }
+
+	void clear()
+	{
+		centerX.clear();
+		centerY.clear();
+		centerZ.clear();
+		radius.clear();
+		count = 0;
+	}
+
+	int add(const Vector3& center, float r)
+	{
+		if (count == int(radius.size()))
+		{
+			int padded = count + Padding;
+			centerX.resize(padded, 0.f);
+			centerY.resize(padded, 0.f);
+			centerZ.resize(padded, 0.f);
+			radius.resize(padded, 0.f);
+		}
+
+		centerX[count] = center.x;
+		centerY[count] = center.y;
+		centerZ[count] = center.z;
+		radius[count] = r;
+		return count++;
+	}
+
+	// Closest sphere hit with tMin < t < tMax. Returns its index and sets tOut, or -1.
+	int closestHit(const Vector3& o, const Vector3& d, float tMin, float tMax, float& tOut) const
+	{
+#if defined(RT_SSE)
+		float origin[3] = { o.x, o.y, o.z };
+		float direction[3] = { d.x, d.y, d.z };
+		return sphereKernels().closestHit(arrays(), origin, direction, tMin, tMax, tOut);
+#else
+		return closestHitScalar(o, d, tMin, tMax, tOut);
+#endif
+	}
+
+	// Lowest indexed sphere hit with tMin < t < tMax, without looking for anything closer.
+	int firstHit(const Vector3& o, const Vector3& d, float tMin, float tMax, float& tOut) const
+	{
+#if defined(RT_SSE)
+		float origin[3] = { o.x, o.y, o.z };
+		float direction[3] = { d.x, d.y, d.z };
+		return sphereKernels().firstHit(arrays(), origin, direction, tMin, tMax, tOut);
+#else
+		return firstHitScalar(o, d, tMin, tMax, tOut);
+#endif
+	}
+
+	// Closest hit among the given spheres for every ray of the packet. candidates must be in
+	// increasing index order (e.g. the spheres left after frustum culling). Rays that hit
+	// nothing get tMax and -1.
+	void closestHitPacket(const RayPacket& packet, const int* candidates, int numCandidates, float tMin, float tMax, float* tOut, int* indexOut) const
+	{
+#if defined(RT_SSE)
+		PacketArrays rays = { { packet.origin.x, packet.origin.y, packet.origin.z }, packet.dirX, packet.dirY, packet.dirZ, packet.count };
+		sphereKernels().closestHitPacket(arrays(), rays, candidates, numCandidates, tMin, tMax, tOut, indexOut);
+#else
+		for (int r = 0; r < packet.count; r++)
+		{
+			Vector3 d = packet.direction(r);
+			float closestT = tMax;
+			int closest = -1;
+			float t;
+			for (int k = 0; k < numCandidates; k++)
+			{
+				if (intersect(candidates[k], packet.origin, d, t) && t < closestT && t > tMin)
+				{
+					closestT = t;
+					closest = candidates[k];
+				}
+			}
+
+			tOut[r] = closestT;
+			indexOut[r] = closest;
+		}
+#endif
+	}
+
+	// Any sphere hit with tMin < t < tMax, for occlusion: stops at the first one and returns its index, or -1
+	inline int anyHit(const Vector3& o, const Vector3& d, float tMin, float tMax) const
+	{
+		float t;
+		return firstHit(o, d, tMin, tMax, t);
+	}
+
+	// Whether sphere i is hit with tMin < t < tMax
+	inline bool hits(int i, const Vector3& o, const Vector3& d, float tMin, float tMax) const
+	{
+		float t;
+		return intersect(i, o, d, t) && t < tMax && t > tMin;
+	}
+
+	inline bool intersect(int i, const Vector3& o, const Vector3& d, float& t) const
+	{
+		Vector3 oc = o - Vector3(centerX[i], centerY[i], centerZ[i]);
+		float a = d.dot(d);
+		float b = 2.f * oc.dot(d);
+		float c = oc.dot(oc) - radius[i] * radius[i];
+		float discriminant = b * b - 4 * a*c;
+		if (discriminant > 0)
+		{
+			t = (-b - sqrtf(discriminant)) / (2.f * a);
+			return true;
+		}
+
+		return false;
+	}
+
+	int closestHitScalar(const Vector3& o, const Vector3& d, float tMin, float tMax, float& tOut) const
+	{
+		int closest = -1;
+		float t;
+		for (int i = 0; i < size(); i++)
+		{
+			if (intersect(i, o, d, t) && t < tMax && t > tMin)
+			{
+				tMax = t;
+				closest = i;
+			}
+		}
+
+		tOut = tMax;
+		return closest;
+	}
+
+	int firstHitScalar(const Vector3& o, const Vector3& d, float tMin, float tMax, float& tOut) const
+	{
+		float t;
+		for (int i = 0; i < size(); i++)
+		{
+			if (intersect(i, o, d, t) && t < tMax && t > tMin)
+			{
+				tOut = t;
+				return i;
+			}
+		}
+
+		return -1;
+	}
+
+private:
+
+	// What the vector kernels get to see
+	inline SphereArrays arrays() const
+	{
+		SphereArrays a = { centerX.data(), centerY.data(), centerZ.data(), radius.data(), count };
+		return a;
+	}
+
+	int count;
+};
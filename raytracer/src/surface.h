@@ -1,17 +1,65 @@
 #pragma once
 
 #include "ray.h"
+#include "aabb.h"
+#include "ray_packet.h"
 
-class Material;
+class Surface;
+
+// Index into a MaterialTable
+typedef int MaterialId;
 
 struct hit_record {
 	float t;
 	Vector3 p;
 	Vector3 normal;
-	Material* mat;
+	MaterialId mat;
+};
+
+// What traversal keeps for the closest hit so far: only how far and what was hit.
+// The rest of the hit_record is worked out once, for the final hit (Surface::fillHit).
+struct SurfaceHit {
+	float t;
+	const Surface* surface;	// the primitive, or set of primitives, that was hit
+	int primitive;			// which one, for a set
 };
 
 class Surface {
 public:
-	virtual bool hit(const Ray& r, float tMin, float tMax, hit_record&rec) const = 0;
+	// Closest hit with tMin < t < tMax, without hit point, normal or material
+	virtual bool intersect(const Ray& r, float tMin, float tMax, SurfaceHit& hit) const = 0;
+
+	// Fills in rec for a hit that intersect reported as being on this surface.
+	// Surfaces that only group others never report themselves, so they can leave this out.
+	virtual void fillHit(const Ray&, const SurfaceHit&, hit_record&) const {}
+
+	// Closest hit with everything filled in
+	inline bool hit(const Ray& r, float tMin, float tMax, hit_record& rec) const
+	{
+		SurfaceHit closest;
+		if (!intersect(r, tMin, tMax, closest))
+		{
+			return false;
+		}
+
+		closest.surface->fillHit(r, closest, rec);
+		return true;
+	}
+
+	// Returns false if the surface can't be bounded (e.g. an empty group)
+	virtual bool boundingBox(AABB& box) const = 0;
+
+	// Closest hit for every ray of the packet within (tMin, tMax[i]). For rays that hit, tMax[i]
+	// is lowered to the hit, recs[i] filled in and hits[i] set. By default one ray at a time.
+	virtual void hitPacket(const RayPacket& packet, float tMin, float* tMax, hit_record* recs, bool* hits) const
+	{
+		for (int i = 0; i < packet.count; i++)
+		{
+			if (hit(Ray(packet.origin, packet.direction(i)), tMin, tMax[i], recs[i]))
+			{
+				tMax[i] = recs[i].t;
+				hits[i] = true;
+			}
+		}
+	}
 };
@@ -1,34 +1,99 @@
 #pragma once
 
+#include <vector>
 #include "surface.h"
+#include "sphere.h"
+#include "sphere_pool.h"
+
+/////////////////////////////////////////////////////////////////
+//
+// class SurfaceGroup - a list of surfaces tested one after another.
+//
+// The spheres in it are copied into a SpherePool when the list is
+// set, so changing the list, or a sphere in it, only shows once
+// set() or update() has packed it again.
+//
+/////////////////////////////////////////////////////////////////
 
 class SurfaceGroup : public Surface {
 public:
-	SurfaceGroup() {}
-	SurfaceGroup(Surface **l, int n) { list = l; length = n; }
+	SurfaceGroup() : list(NULL), length(0) {}
+	SurfaceGroup(Surface **l, int n) : list(NULL), length(0) { set(l, n); }
 
-	virtual bool hit(const Ray& r, float tMin, float tMax, hit_record&rec) const;
+	void set(Surface **l, int n) { list = l; length = n; pack(); }
 
-public:
+	// After surfaces in the list were changed in place
+	void update() { pack(); }
+
+	virtual bool intersect(const Ray& r, float tMin, float tMax, SurfaceHit& hit) const;
+	virtual bool boundingBox(AABB& box) const;
+
+	inline Surface* const* surfaces() const { return list; }
+	inline int size() const { return length; }
+
+private:
+
+	// Splits list into spheres, tested several at a time, and everything else
+	void pack();
 
 	Surface **list;
 	int length;
+
+	SpherePool spheres;
+	std::vector<Surface*> others;
 };
 
-bool SurfaceGroup::hit(const Ray& r, float tMin, float tMax, hit_record&rec) const
+void SurfaceGroup::pack()
+{
+	spheres = SpherePool();
+	others.clear();
+	for (int i = 0; i < length; i++)
+	{
+		const Sphere* sphere = dynamic_cast<const Sphere*>(list[i]);
+		if (sphere != NULL)
+		{
+			spheres.add(sphere->center, sphere->radius, sphere->material);
+		}
+		else
+		{
+			others.push_back(list[i]);
+		}
+	}
+}
+
+bool SurfaceGroup::intersect(const Ray& r, float tMin, float tMax, SurfaceHit& hit) const
 {
-	hit_record temp_r;
 	bool hitAny = false;
-	double closestSoFar = tMax;
+	float closestSoFar = tMax;
 
-	for (int i = 0; i < length; i++)
+	if (spheres.intersect(r, tMin, closestSoFar, hit)) {
+		hitAny = true;
+		closestSoFar = hit.t;
+	}
+
+	for (size_t i = 0; i < others.size(); i++)
 	{
-		if (list[i]->hit(r, tMin, closestSoFar, temp_r)) {
+		if (others[i]->intersect(r, tMin, closestSoFar, hit)) {
 			hitAny = true;
-			closestSoFar = temp_r.t;
-			rec = temp_r;
+			closestSoFar = hit.t;
 		}
 	}
 
 	return hitAny;
 }
+
+bool SurfaceGroup::boundingBox(AABB& box) const
+{
+	box = AABB();
+	for (int i = 0; i < length; i++)
+	{
+		AABB childBox;
+		if (!list[i]->boundingBox(childBox))
+		{
+			return false;
+		}
+		box.grow(childBox);
+	}
+
+	return length > 0;
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <math.h>
+#include <limits>
+#include <vector>
+#include "config.h"
+#include "film.h"
+#include "surface.h"
+#include "tile_scheduler.h"
+
+/////////////////////////////////////////////////////////////////
+//
+// class TemporalReprojection - carries the samples a Film has
+// gathered over to the next view when the camera moves.
+//
+// It keeps the depth (distance from the camera) of what the centre
+// of every pixel sees. When the view changes, each new pixel's
+// centre ray finds its point in the world, which is projected into
+// the old view to find the pixel that saw it. That pixel's samples
+// are reused if its depth agrees; if not the point was hidden, or
+// off screen, last time and the pixel starts from scratch. Sky
+// pixels are matched by direction alone.
+//
+// Reused samples count as at most Config::temporalHistory, so the
+// new view's samples blend in quickly and the image doesn't smear.
+//
+/////////////////////////////////////////////////////////////////
+
+// How far two depths may disagree, relative to the depth, and still be the same surface
+const float ReprojectionDepthTolerance = 0.02f;
+
+class TemporalReprojection
+{
+public:
+
+	TemporalReprojection() : width(0), height(0) {}
+
+	// Whether film can be reprojected from view a to view b: only the camera may differ
+	static bool compatible(const Config& a, const Config& b)
+	{
+		return b.temporalHistory > 0 && a.nx == b.nx && a.ny == b.ny &&
+			a.seed == b.seed && a.sampler == b.sampler && a.maxDepth == b.maxDepth && a.rrStartDepth == b.rrStartDepth;
+	}
+
+	// For a film that was just cleared for view c
+	void reset(const Surface& world, const Config& c)
+	{
+		resize(c);
+		TileScheduler::shared(c.threads).run(c.nx, c.ny, [&](const Tile& tile) {
+			for (int j = tile.y0; j < tile.y1; j++)
+			{
+				for (int i = tile.x0; i < tile.x1; i++)
+				{
+					depth[j * width + i] = pixelDepth(world, c, i, j);
+				}
+			}
+		});
+	}
+
+	// Replaces film, which holds samples for view from, by one for view to holding the samples
+	// that are still valid
+	void reproject(const Surface& world, const Config& from, const Config& to, Film& film)
+	{
+		if (width != from.nx || height != from.ny)
+		{
+			// No depths for the old view, nothing can be matched
+			film.resize(to.nx, to.ny);
+			reset(world, to);
+			return;
+		}
+
+		std::vector<float> oldDepth;
+		oldDepth.swap(depth);
+		resize(to);
+
+		Film next(to.nx, to.ny);
+		Projection previous(from);
+		TileScheduler::shared(to.threads).run(to.nx, to.ny, [&](const Tile& tile) {
+			for (int j = tile.y0; j < tile.y1; j++)
+			{
+				for (int i = tile.x0; i < tile.x1; i++)
+				{
+					float d = pixelDepth(world, to, i, j);
+					depth[j * width + i] = d;
+
+					Vector3 direction = pixelDirection(to, i, j);
+					bool sky = d == INFINITY;
+					Vector3 seen = sky ? direction : to.origin + direction.normalized() * d - from.origin;
+
+					int oi, oj;
+					if (!previous.pixel(seen, oi, oj))
+					{
+						continue;
+					}
+
+					float old = oldDepth[oj * width + oi];
+					bool match = sky ? old == INFINITY : fabsf(old - seen.magnitude()) <= ReprojectionDepthTolerance * old;
+					if (match)
+					{
+						next.reuse(film, oi, oj, i, j, to.temporalHistory);
+					}
+				}
+			}
+		});
+
+		std::swap(film, next);
+	}
+
+private:
+
+	// Maps directions from a view's camera to the pixels of that view
+	class Projection
+	{
+	public:
+		explicit Projection(const Config& c) : c(c)
+		{
+			// Solves direction = s * (lowerLeft + u * horizontal + v * vertical) for (s, s u, s v)
+			// by Cramer's rule
+			hCrossV = c.horizontal.cross(c.vertical);
+			vCrossL = c.vertical.cross(c.lowerLeft);
+			lCrossH = c.lowerLeft.cross(c.horizontal);
+			determinant = c.lowerLeft.dot(hCrossV);
+		}
+
+		// False if the direction is behind the camera or outside the view
+		bool pixel(const Vector3& direction, int& i, int& j) const
+		{
+			float s = direction.dot(hCrossV) / determinant;
+			if (!(s > 0.f))
+			{
+				return false;
+			}
+
+			float u = direction.dot(vCrossL) / determinant / s;
+			float v = direction.dot(lCrossH) / determinant / s;
+			if (!(u >= 0.f && u < 1.f && v >= 0.f && v < 1.f))
+			{
+				return false;
+			}
+
+			i = std::min(int(u * c.nx), c.nx - 1);
+			j = std::min(int(v * c.ny), c.ny - 1);
+			return true;
+		}
+
+	private:
+		const Config& c;
+		Vector3 hCrossV;
+		Vector3 vCrossL;
+		Vector3 lCrossH;
+		float determinant;
+	};
+
+	void resize(const Config& c)
+	{
+		width = c.nx;
+		height = c.ny;
+		depth.resize(size_t(width) * height);
+	}
+
+	static Vector3 pixelDirection(const Config& c, int i, int j)
+	{
+		float u = (float(i) + 0.5f) / float(c.nx);
+		float v = (float(j) + 0.5f) / float(c.ny);
+		return c.lowerLeft + u * c.horizontal + v * c.vertical;
+	}
+
+	// Distance to what the centre of pixel (i, j) sees, INFINITY for the sky
+	static float pixelDepth(const Surface& world, const Config& c, int i, int j)
+	{
+		Ray r(c.origin, pixelDirection(c, i, j));
+		SurfaceHit hit;
+		if (!world.intersect(r, 0.001f, std::numeric_limits<float>::max(), hit))
+		{
+			return INFINITY;
+		}
+		return hit.t * r.direction().magnitude();
+	}
+
+	int width;
+	int height;
+	std::vector<float> depth;		// of the view the film holds
+};
@@ -1,31 +1,193 @@
 #include <iostream>
 #include <fstream>
+#include <algorithm>
 #include <string.h>
+#include <stdint.h>
 #include <time.h>
 #include <math.h>
+#include <memory>
+#include <thread>
+#include <vector>
 #include "tgaimage.h"
 
-TGAImage::TGAImage() : data(NULL), width(0), height(0), bytespp(0) {}
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-TGAImage::TGAImage(int w, int h, int bpp) : data(NULL), width(w), height(h), bytespp(bpp) {
+namespace {
+	// Each thread encodes at least this many pixels (about a millisecond's worth), so smaller
+	// images are encoded on fewer threads, and those under twice this on the calling thread alone
+	const size_t rle_pixels_per_thread = 1 << 18;
+	const size_t rle_max_chunk_length = 128;
+
+	template <int Bpp> inline bool same_pixel(const unsigned char* a, const unsigned char* b) {
+		return memcmp(a, b, Bpp) == 0;
+	}
+
+	template <> inline bool same_pixel<4>(const unsigned char* a, const unsigned char* b) {
+		uint32_t pa, pb;
+		memcpy(&pa, a, 4);
+		memcpy(&pb, b, 4);
+		return pa == pb;
+	}
+
+	// Pixels from p on (at most max) equal to p
+	template <int Bpp> inline size_t run_length(const unsigned char* p, size_t max) {
+		size_t n = 1;
+		while (n < max && same_pixel<Bpp>(p, p + n * Bpp)) n++;
+		return n;
+	}
+
+	// Two pixels a word, then one
+	template <> inline size_t run_length<4>(const unsigned char* p, size_t max) {
+		uint32_t pixel;
+		memcpy(&pixel, p, 4);
+		uint64_t pair = (uint64_t(pixel) << 32) | pixel;
+		size_t n = 1;
+		for (; n + 2 <= max; n += 2) {
+			uint64_t next;
+			memcpy(&next, p + n * 4, 8);
+			if (next != pair) break;
+		}
+		while (n < max && same_pixel<4>(p, p + n * 4)) n++;
+		return n;
+	}
+
+	// Run packets for 2 or more equal pixels; raw packets stop before the first pixel that equals
+	// the one after it
+	template <int Bpp> size_t encode_rle_span(const unsigned char* pixels, size_t npixels, unsigned char* out) {
+		unsigned char* start = out;
+		size_t curpix = 0;
+		while (curpix < npixels) {
+			const unsigned char* p = pixels + curpix * Bpp;
+			size_t left = std::min(npixels - curpix, rle_max_chunk_length);
+			size_t length = run_length<Bpp>(p, left);
+			if (length > 1) {
+				*out++ = (unsigned char)(length + 127);
+				memcpy(out, p, Bpp);
+				out += Bpp;
+			}
+			else {
+				while (length < left && !(length + 1 < left && same_pixel<Bpp>(p + length * Bpp, p + (length + 1) * Bpp))) length++;
+				*out++ = (unsigned char)(length - 1);
+				memcpy(out, p, length * Bpp);
+				out += length * Bpp;
+			}
+			curpix += length;
+		}
+		return (size_t)(out - start);
+	}
+
+	inline void fill_pixels(unsigned char* out, const unsigned char* pixel, size_t count, int bytespp) {
+		if (bytespp == 4) {
+			uint32_t value;
+			memcpy(&value, pixel, 4);
+			for (size_t i = 0; i < count; i++) memcpy(out + i * 4, &value, 4);
+		}
+		else if (bytespp == 1) {
+			memset(out, *pixel, count);
+		}
+		else {
+			for (size_t i = 0; i < count; i++) memcpy(out + i * bytespp, pixel, bytespp);
+		}
+	}
+
+	// Private (copy-on-write) mapping of the whole file, writable without changing it
+	unsigned char* map_file(const char* filename, size_t& size) {
+#if defined(_WIN32)
+		HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) return NULL;
+		LARGE_INTEGER length;
+		if (!GetFileSizeEx(file, &length) || length.QuadPart == 0 || (unsigned long long)length.QuadPart > SIZE_MAX) {
+			CloseHandle(file);
+			return NULL;
+		}
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+		CloseHandle(file);
+		if (!mapping) return NULL;
+		// The view keeps the mapping alive
+		void* view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+		CloseHandle(mapping);
+		if (!view) return NULL;
+		size = (size_t)length.QuadPart;
+		return (unsigned char*)view;
+#else
+		int file = open(filename, O_RDONLY);
+		if (file < 0) return NULL;
+		struct stat info;
+		if (fstat(file, &info) != 0 || info.st_size == 0 || (unsigned long long)info.st_size > SIZE_MAX) {
+			close(file);
+			return NULL;
+		}
+		void* view = mmap(NULL, size_t(info.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+		close(file);
+		if (view == MAP_FAILED) return NULL;
+		size = (size_t)info.st_size;
+		return (unsigned char*)view;
+#endif
+	}
+
+	void unmap_file(unsigned char* view, size_t size) {
+#if defined(_WIN32)
+		UnmapViewOfFile(view);
+#else
+		munmap(view, size);
+#endif
+	}
+}
+
+TGAImage::TGAImage() : data(NULL), width(0), height(0), bytespp(0), mapped(NULL), mapped_size(0) {}
+
+TGAImage::TGAImage(int w, int h, int bpp) : data(NULL), width(w), height(h), bytespp(bpp), mapped(NULL), mapped_size(0) {
 	unsigned long nbytes = width * height * bytespp;
 	data = new unsigned char[nbytes];
 	memset(data, 0, nbytes);
 }
 
-TGAImage::TGAImage(const TGAImage& img) : data(NULL), width(img.width), height(img.height), bytespp(img.bytespp) {
+TGAImage::TGAImage(const TGAImage& img) : data(NULL), width(img.width), height(img.height), bytespp(img.bytespp), mapped(NULL), mapped_size(0) {
 	unsigned long nbytes = width * height * bytespp;
 	data = new unsigned char[nbytes];
 	memcpy(data, img.data, nbytes);
 }
 
 TGAImage::~TGAImage() {
-	if (data) delete[] data;
+	release();
+}
+
+void TGAImage::release() {
+	if (mapped) {
+		unmap_file(mapped, mapped_size);
+		mapped = NULL;
+		mapped_size = 0;
+	}
+	else if (data) {
+		delete[] data;
+	}
+	data = NULL;
+}
+
+// Moves the pixels of a mapped image into memory of its own
+void TGAImage::detach() {
+	if (!mapped) return;
+	unsigned long nbytes = width * height * bytespp;
+	unsigned char* owned = new unsigned char[nbytes];
+	memcpy(owned, data, nbytes);
+	unmap_file(mapped, mapped_size);
+	mapped = NULL;
+	mapped_size = 0;
+	data = owned;
 }
 
 TGAImage& TGAImage::operator =(const TGAImage& img) {
 	if (this != &img) {
-		if (data) delete[] data;
+		release();
 		width = img.width;
 		height = img.height;
 		bytespp = img.bytespp;
@@ -37,49 +199,51 @@ TGAImage& TGAImage::operator =(const TGAImage& img) {
 }
 
 bool TGAImage::read_tga_file(const char* filename) {
-	if (data) delete[] data;
-	data = NULL;
-	std::ifstream in;
-	in.open(filename, std::ios::binary);
-	if (!in.is_open()) {
+	release();
+	size_t size = 0;
+	unsigned char* file = map_file(filename, size);
+	if (!file) {
 		std::cerr << "can't open file " << filename << "\n";
-		in.close();
 		return false;
 	}
 	TGA_Header header;
-	in.read((char*)& header, sizeof(header));
-	if (!in.good()) {
-		in.close();
+	if (size < sizeof(header)) {
+		unmap_file(file, size);
 		std::cerr << "an error occured while reading the header\n";
 		return false;
 	}
+	memcpy((void*)& header, file, sizeof(header));
 	width = header.width;
 	height = header.height;
 	bytespp = header.bitsperpixel >> 3;
 	if (width <= 0 || height <= 0 || (bytespp != GRAYSCALE && bytespp != RGB && bytespp != RGBA)) {
-		in.close();
+		unmap_file(file, size);
 		std::cerr << "bad bpp (or width/height) value\n";
 		return false;
 	}
-	unsigned long nbytes = bytespp * width * height;
-	data = new unsigned char[nbytes];
+	size_t nbytes = size_t(bytespp) * width * height;
 	if (3 == header.datatypecode || 2 == header.datatypecode) {
-		in.read((char*)data, nbytes);
-		if (!in.good()) {
-			in.close();
+		if (size - sizeof(header) < nbytes) {
+			unmap_file(file, size);
 			std::cerr << "an error occured while reading the data\n";
 			return false;
 		}
+		// No copy: the pixels are read (and, being a private mapping, changed) in place
+		mapped = file;
+		mapped_size = size;
+		data = file + sizeof(header);
 	}
 	else if (10 == header.datatypecode || 11 == header.datatypecode) {
-		if (!load_rle_data(in)) {
-			in.close();
+		data = new unsigned char[nbytes];
+		bool loaded = load_rle_data(file + sizeof(header), size - sizeof(header));
+		unmap_file(file, size);
+		if (!loaded) {
 			std::cerr << "an error occured while reading the data\n";
 			return false;
 		}
 	}
 	else {
-		in.close();
+		unmap_file(file, size);
 		std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
 		return false;
 	}
@@ -90,57 +254,41 @@ bool TGAImage::read_tga_file(const char* filename) {
 		flip_horizontally();
 	}
 	std::cerr << width << "x" << height << "/" << bytespp * 8 << "\n";
-	in.close();
 	return true;
 }
 
-bool TGAImage::load_rle_data(std::ifstream& in) {
-	unsigned long pixelcount = width * height;
-	unsigned long currentpixel = 0;
-	unsigned long currentbyte = 0;
-	TGAColor colorbuffer;
-	do {
-		unsigned char chunkheader = 0;
-		chunkheader = in.get();
-		if (!in.good()) {
+bool TGAImage::load_rle_data(const unsigned char* in, size_t size) {
+	size_t pixelcount = size_t(width) * height;
+	size_t currentpixel = 0;
+	const unsigned char* end = in + size;
+	unsigned char* out = data;
+	while (currentpixel < pixelcount) {
+		if (in == end) {
 			std::cerr << "an error occured while reading the data\n";
 			return false;
 		}
-		if (chunkheader < 128) {
-			chunkheader++;
-			for (int i = 0; i < chunkheader; i++) {
-				in.read((char*)colorbuffer.bgra, bytespp);
-				if (!in.good()) {
-					std::cerr << "an error occured while reading the header\n";
-					return false;
-				}
-				for (int t = 0; t < bytespp; t++)
-					data[currentbyte++] = colorbuffer.bgra[t];
-				currentpixel++;
-				if (currentpixel > pixelcount) {
-					std::cerr << "Too many pixels read\n";
-					return false;
-				}
-			}
+		size_t chunkheader = *in++;
+		bool run = chunkheader >= 128;
+		size_t count = run ? chunkheader - 127 : chunkheader + 1;
+		size_t nbytes = (run ? 1 : count) * bytespp;
+		if ((size_t)(end - in) < nbytes) {
+			std::cerr << "an error occured while reading the data\n";
+			return false;
+		}
+		if (currentpixel + count > pixelcount) {
+			std::cerr << "Too many pixels read\n";
+			return false;
+		}
+		if (run) {
+			fill_pixels(out, in, count, bytespp);
 		}
 		else {
-			chunkheader -= 127;
-			in.read((char*)colorbuffer.bgra, bytespp);
-			if (!in.good()) {
-				std::cerr << "an error occured while reading the header\n";
-				return false;
-			}
-			for (int i = 0; i < chunkheader; i++) {
-				for (int t = 0; t < bytespp; t++)
-					data[currentbyte++] = colorbuffer.bgra[t];
-				currentpixel++;
-				if (currentpixel > pixelcount) {
-					std::cerr << "Too many pixels read\n";
-					return false;
-				}
-			}
+			memcpy(out, in, nbytes);
 		}
-	} while (currentpixel < pixelcount);
+		in += nbytes;
+		out += count * bytespp;
+		currentpixel += count;
+	}
 	return true;
 }
 
@@ -148,6 +296,8 @@ bool TGAImage::write_tga_file(const char* filename, bool rle) {
 	unsigned char developer_area_ref[4] = { 0, 0, 0, 0 };
 	unsigned char extension_area_ref[4] = { 0, 0, 0, 0 };
 	unsigned char footer[18] = { 'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0' };
+	// Opening the file truncates it, which may be the one the pixels are mapped from
+	detach();
 	std::ofstream out;
 	out.open(filename, std::ios::binary);
 	if (!out.is_open()) {
@@ -169,7 +319,7 @@ bool TGAImage::write_tga_file(const char* filename, bool rle) {
 		return false;
 	}
 	if (!rle) {
-		out.write((char*)data, width * height * bytespp);
+		out.write((char*)data, size_t(width) * height * bytespp);
 		if (!out.good()) {
 			std::cerr << "can't unload raw data\n";
 			out.close();
@@ -205,49 +355,62 @@ bool TGAImage::write_tga_file(const char* filename, bool rle) {
 	return true;
 }
 
+// Blocks of rows are encoded in parallel into one buffer (packets don't cross blocks), which is
+// then written at once.
 // TODO: it is not necessary to break a raw chunk for two equal pixels (for the matter of the resulting size)
 bool TGAImage::unload_rle_data(std::ofstream& out) {
-	const unsigned char max_chunk_length = 128;
-	unsigned long npixels = width * height;
-	unsigned long curpix = 0;
-	while (curpix < npixels) {
-		unsigned long chunkstart = curpix * bytespp;
-		unsigned long curbyte = curpix * bytespp;
-		unsigned char run_length = 1;
-		bool raw = true;
-		while (curpix + run_length < npixels && run_length < max_chunk_length) {
-			bool succ_eq = true;
-			for (int t = 0; succ_eq && t < bytespp; t++) {
-				succ_eq = (data[curbyte + t] == data[curbyte + t + bytespp]);
-			}
-			curbyte += bytespp;
-			if (1 == run_length) {
-				raw = !succ_eq;
-			}
-			if (raw && succ_eq) {
-				run_length--;
-				break;
-			}
-			if (!raw && !succ_eq) {
-				break;
-			}
-			run_length++;
-		}
-		curpix += run_length;
-		out.put(raw ? run_length - 1 : run_length + 127);
-		if (!out.good()) {
-			std::cerr << "can't dump the tga file\n";
-			return false;
-		}
-		out.write((char*)(data + chunkstart), (raw ? run_length * bytespp : bytespp));
-		if (!out.good()) {
-			std::cerr << "can't dump the tga file\n";
-			return false;
-		}
+	size_t npixels = size_t(width) * height;
+	size_t nthreads = std::max(1u, std::thread::hardware_concurrency());
+	int nblocks = (int)std::max<size_t>(1, std::min(std::min(nthreads, npixels / rle_pixels_per_thread), (size_t)height));
+
+	// Block b is rows [height * b / nblocks, height * (b + 1) / nblocks), encoded at rle_bound of its first pixel
+	// Not a vector, which would clear it first
+	std::unique_ptr<unsigned char[]> buffer(new unsigned char[rle_bound(npixels, bytespp)]);
+	std::vector<size_t> sizes(nblocks);
+	auto encode_block = [&](int b) {
+		size_t first = (size_t)(height * (long long)b / nblocks) * width;
+		size_t last = (size_t)(height * (long long)(b + 1) / nblocks) * width;
+		sizes[b] = encode_rle(data + first * bytespp, last - first, bytespp, &buffer[rle_bound(first, bytespp)]);
+	};
+
+	// The calling thread takes block 0, so a small image starts no threads at all
+	std::vector<std::thread> threads;
+	for (int b = 1; b < nblocks; b++) {
+		threads.push_back(std::thread(encode_block, b));
+	}
+	encode_block(0);
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i].join();
+	}
+
+	size_t length = sizes[0];
+	for (int b = 1; b < nblocks; b++) {
+		size_t first = (size_t)(height * (long long)b / nblocks) * width;
+		memmove(&buffer[length], &buffer[rle_bound(first, bytespp)], sizes[b]);
+		length += sizes[b];
+	}
+
+	out.write((char*)buffer.get(), length);
+	if (!out.good()) {
+		std::cerr << "can't dump the tga file\n";
+		return false;
 	}
 	return true;
 }
 
+size_t TGAImage::encode_rle(const unsigned char* pixels, size_t npixels, int bytespp, unsigned char* out) {
+	switch (bytespp) {
+	case GRAYSCALE: return encode_rle_span<1>(pixels, npixels, out);
+	case RGB: return encode_rle_span<3>(pixels, npixels, out);
+	default: return encode_rle_span<4>(pixels, npixels, out);
+	}
+}
+
+// Every packet holds at least one pixel, so a header per pixel at worst
+size_t TGAImage::rle_bound(size_t npixels, int bytespp) {
+	return npixels * (bytespp + 1);
+}
+
 TGAColor TGAImage::get(int x, int y) {
 	if (!data || x < 0 || y < 0 || x >= width || y >= height) {
 		return TGAColor();
@@ -351,7 +514,7 @@ bool TGAImage::scale(int w, int h) {
 			nscanline += nlinebytes;
 		}
 	}
-	delete[] data;
+	release();
 	data = tdata;
 	width = w;
 	height = h;
@@ -2,6 +2,7 @@
 #define __IMAGE_H__
 
 #include <fstream>
+#include <stddef.h>
 #include <vector>
 
 #pragma pack(push,1)
@@ -102,9 +103,13 @@ protected:
 	int width;
 	int height;
 	int bytespp;
+	unsigned char* mapped;		// the file data points into, if it isn't allocated
+	size_t mapped_size;
 
-	bool   load_rle_data(std::ifstream& in);
+	bool   load_rle_data(const unsigned char* in, size_t size);
 	bool unload_rle_data(std::ofstream& out);
+	void release();
+	void detach();
 public:
 	enum Format {
 		GRAYSCALE = 1, RGB = 3, RGBA = 4
@@ -113,7 +118,12 @@ public:
 	TGAImage();
 	TGAImage(int w, int h, int bpp);
 	TGAImage(const TGAImage& img);
+	// Maps the file copy-on-write: an uncompressed image's pixels stay in the mapping (changing
+	// them doesn't change the file), RLE is decoded from it. Until the image is written out or
+	// read again it must not outlive changes to the file: truncating or rewriting it from
+	// elsewhere faults on the pixels not yet touched.
 	bool read_tga_file(const char* filename);
+	// Copies mapped pixels out of their file first, so writing back to it is fine
 	bool write_tga_file(const char* filename, bool rle = true);
 	bool flip_horizontally();
 	bool flip_vertically();
@@ -128,6 +138,11 @@ public:
 	int get_bytespp();
 	unsigned char* buffer();
 	void clear();
+
+	// RLE packets for npixels pixels, none crossing the end; returns the bytes written to out,
+	// which must have room for rle_bound(npixels, bytespp)
+	static size_t encode_rle(const unsigned char* pixels, size_t npixels, int bytespp, unsigned char* out);
+	static size_t rle_bound(size_t npixels, int bytespp);
 };
 
 #endif //__IMAGE_H__
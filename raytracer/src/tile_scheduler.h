@@ -0,0 +1,211 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/////////////////////////////////////////////////////////////////
+//
+// class TileScheduler - splits an image into tiles and renders them
+// on a persistent pool of worker threads.
+//
+// Every worker (the calling thread is worker 0) gets a contiguous run
+// of tiles in its own queue and takes from the back of it. Once it
+// runs dry it steals from the front of the other queues, so workers
+// that got cheap tiles (sky) help out with expensive ones (metals).
+//
+/////////////////////////////////////////////////////////////////
+
+struct Tile
+{
+	int x0, y0;		// inclusive
+	int x1, y1;		// exclusive
+};
+
+class TileScheduler
+{
+public:
+
+	typedef std::function<void(const Tile&)> TileFunc;
+
+	static const int DefaultTileSize = 32;
+
+	// numThreads <= 0 means one per hardware thread
+	explicit TileScheduler(int numThreads = 0) : job(NULL), generation(0), busyWorkers(0), quit(false)
+	{
+		if (numThreads <= 0)
+		{
+			numThreads = std::max(1, int(std::thread::hardware_concurrency()));
+		}
+
+		for (int i = 0; i < numThreads; i++)
+		{
+			queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+		}
+
+		for (int i = 1; i < numThreads; i++)
+		{
+			threads.push_back(std::thread(&TileScheduler::workerLoop, this, i));
+		}
+	}
+
+	~TileScheduler()
+	{
+		{
+			std::lock_guard<std::mutex> lock(jobLock);
+			quit = true;
+		}
+		jobStart.notify_all();
+
+		for (size_t i = 0; i < threads.size(); i++)
+		{
+			threads[i].join();
+		}
+	}
+
+	// Process wide scheduler. Asking for a different thread count recreates it,
+	// so don't do that while it's running.
+	static TileScheduler& shared(int numThreads = 0)
+	{
+		static std::unique_ptr<TileScheduler> instance;
+		static int requested = -1;
+		if (!instance || requested != numThreads)
+		{
+			instance.reset();
+			instance.reset(new TileScheduler(numThreads));
+			requested = numThreads;
+		}
+
+		return *instance;
+	}
+
+	inline int threadCount() const { return int(queues.size()); }
+
+	// Calls renderTile once for every tile covering width x height and returns when all are done.
+	// One thread at a time: a render thread of its own has to be the only one calling it.
+	void run(int width, int height, const TileFunc& renderTile, int tileSize = DefaultTileSize)
+	{
+		std::vector<Tile> tiles;
+		for (int y = 0; y < height; y += tileSize)
+		{
+			for (int x = 0; x < width; x += tileSize)
+			{
+				Tile t = { x, y, std::min(x + tileSize, width), std::min(y + tileSize, height) };
+				tiles.push_back(t);
+			}
+		}
+
+		int workers = threadCount();
+		size_t perWorker = (tiles.size() + workers - 1) / workers;
+		for (int w = 0; w < workers; w++)
+		{
+			size_t first = std::min(tiles.size(), w * perWorker);
+			size_t last = std::min(tiles.size(), first + perWorker);
+			std::lock_guard<std::mutex> lock(queues[w]->lock);
+			queues[w]->tiles.assign(tiles.begin() + first, tiles.begin() + last);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(jobLock);
+			job = &renderTile;
+			busyWorkers = int(threads.size());
+			generation++;
+		}
+		jobStart.notify_all();
+
+		work(0);
+
+		std::unique_lock<std::mutex> lock(jobLock);
+		jobDone.wait(lock, [this] { return busyWorkers == 0; });
+		job = NULL;
+	}
+
+private:
+
+	struct WorkQueue
+	{
+		std::mutex lock;
+		std::deque<Tile> tiles;
+	};
+
+	// Own queue first (newest tile, most likely still warm), then steal the oldest from the others
+	bool popOrSteal(int worker, Tile& tile)
+	{
+		{
+			WorkQueue& own = *queues[worker];
+			std::lock_guard<std::mutex> lock(own.lock);
+			if (!own.tiles.empty())
+			{
+				tile = own.tiles.back();
+				own.tiles.pop_back();
+				return true;
+			}
+		}
+
+		int workers = threadCount();
+		for (int i = 1; i < workers; i++)
+		{
+			WorkQueue& victim = *queues[(worker + i) % workers];
+			std::lock_guard<std::mutex> lock(victim.lock);
+			if (!victim.tiles.empty())
+			{
+				tile = victim.tiles.front();
+				victim.tiles.pop_front();
+				return true;
+			}
+		}
+
+		// All tiles are queued before any worker starts, so empty everywhere means done
+		return false;
+	}
+
+	void work(int worker)
+	{
+		Tile tile;
+		while (popOrSteal(worker, tile))
+		{
+			(*job)(tile);
+		}
+	}
+
+	void workerLoop(int worker)
+	{
+		unsigned int seen = 0;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(jobLock);
+				jobStart.wait(lock, [this, seen] { return quit || generation != seen; });
+				if (quit)
+				{
+					return;
+				}
+				seen = generation;
+			}
+
+			work(worker);
+
+			{
+				std::lock_guard<std::mutex> lock(jobLock);
+				busyWorkers--;
+			}
+			jobDone.notify_all();
+		}
+	}
+
+	std::vector<std::unique_ptr<WorkQueue>> queues;
+	std::vector<std::thread> threads;
+
+	std::mutex jobLock;
+	std::condition_variable jobStart;
+	std::condition_variable jobDone;
+	const TileFunc* job;
+	unsigned int generation;
+	int busyWorkers;
+	bool quit;
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+
+/////////////////////////////////////////////////////////////////
+//
+// class TripleBuffer - hands finished frames from a render thread
+// to the thread that shows them, without locks and without either
+// side waiting for the other.
+//
+// The producer always has a buffer of its own to draw into (back),
+// and so does the consumer to read from (front). The third one sits
+// in between: publish() swaps the back buffer with it, update()
+// swaps the front buffer with it if it holds a newer frame. Frames
+// the consumer is too slow to see are simply replaced.
+//
+// One producer thread and one consumer thread.
+//
+/////////////////////////////////////////////////////////////////
+
+template <class T>
+class TripleBuffer
+{
+public:
+
+	TripleBuffer() : middle(1), backIndex(0), frontIndex(2) {}
+
+	// Producer: the buffer to draw the next frame into. It holds whatever frame it held last.
+	T& back()
+	{
+		return buffers[backIndex];
+	}
+
+	// Producer: makes the back buffer the newest frame
+	void publish()
+	{
+		backIndex = middle.exchange(backIndex | Fresh, std::memory_order_acq_rel) & IndexMask;
+	}
+
+	// Consumer: moves to the newest frame. False if there is none since the last call.
+	bool update()
+	{
+		if ((middle.load(std::memory_order_relaxed) & Fresh) == 0)
+		{
+			return false;
+		}
+
+		frontIndex = middle.exchange(frontIndex, std::memory_order_acq_rel) & IndexMask;
+		return true;
+	}
+
+	// Consumer: the newest frame as of the last update()
+	T& front()
+	{
+		return buffers[frontIndex];
+	}
+
+private:
+
+	// middle holds the index of the buffer in between, plus Fresh if it is newer than front
+	static const int IndexMask = 3;
+	static const int Fresh = 4;
+
+	T buffers[3];
+	std::atomic<int> middle;
+	int backIndex;		// producer's
+	int frontIndex;		// consumer's
+};
@@ -2,26 +2,59 @@
 #define UTILS
 
 #include <chrono>
+#include <math.h>
+#include "sampler.h"
 
 using namespace std;
 using namespace chrono;
 
 namespace Utils
 {
-	float rand_n()
+	// Uniform in [0, 1)
+	float rand_n(Sampler& sampler)
 	{
-		return (float(rand()) / float(RAND_MAX));
+		return sampler.get1D();
 	}
 
-	Vector3 randomInUnitSphere()
+	// Uniform in the unit ball. Maps 3 sample values straight onto it rather than rejection sampling,
+	// so stratified / low discrepancy samples keep their structure and each call uses exactly 3 dimensions.
+	Vector3 randomInUnitSphere(Sampler& sampler)
 	{
-		Vector3 p;
-		do
+		float z = 1.f - 2.f * rand_n(sampler);
+		float phi = 6.28318531f * rand_n(sampler);
+		float r = cbrtf(rand_n(sampler));
+
+		float planar = r * sqrtf(fmaxf(0.f, 1.f - z * z));
+		return Vector3(planar * cosf(phi), planar * sinf(phi), r * z);
+	}
+
+	// Radiance of the sky seen along direction
+	inline Vector3 skyColor(const Vector3& direction)
+	{
+		Vector3 unitDir(direction);
+		unitDir.normalized();
+		float t = 0.5f * (unitDir.y + 1.f);
+		return (1.f - t) * Vector3(1.0, 1.0, 1.0) + t * Vector3(0.5f, 0.7f, 1.f);
+	}
+
+	// Russian roulette: once the throughput has dropped below 1, the path carries on with
+	// probability q equal to it and the survivors are weighted by 1 / q, which keeps the
+	// estimate unbiased. Returns false if the path ends.
+	inline bool russianRoulette(Vector3& throughput, Sampler& sampler)
+	{
+		float q = fmaxf(throughput.x, fmaxf(throughput.y, throughput.z));
+		if (q >= 1.f)
+		{
+			return true;
+		}
+
+		if (rand_n(sampler) >= q)
 		{
-			p = 2.f * Vector3(rand_n(), rand_n(), rand_n()) - Vector3(1.f);
-		} while (p.magnitudeSquared() >= 1.0);
+			return false;
+		}
 
-		return p;
+		throughput /= q;
+		return true;
 	}
 
 };
@@ -1,31 +1,56 @@
 #pragma once
 
+#include <math.h>
+#include "simd.h"
+
 /////////////////////////////////////////////////////////////////
 //
 // class Vector3 - a simple 3D vector class
 //
+// With SSE the components are padded to four aligned floats (the
+// fourth is unused), loaded into an __m128 for the arithmetic, which
+// is done a whole vector at a time. Every operation still rounds exactly like the scalar
+// version, dot products included, so results don't depend on which
+// one was compiled. Define RT_SCALAR_VECTOR3 to get the plain one.
+//
+// Vector3x4 / Vector3x8 in vector3_wide.h hold 4 or 8 vectors as
+// structure of arrays and offer the same operations.
+//
 /////////////////////////////////////////////////////////////////
 
-class Vector3
+#if defined(RT_SSE) && !defined(RT_SCALAR_VECTOR3)
+#define RT_SSE_VECTOR3 1
+#define RT_VECTOR3_ALIGN alignas(16)
+#else
+#define RT_VECTOR3_ALIGN
+#endif
+
+class RT_VECTOR3_ALIGN Vector3
 {
 public:
 
 	float x, y, z;
+#if defined(RT_SSE_VECTOR3)
+	float w;	// padding, so the vector loads as one __m128
+#endif
 
 	// Constructors
 	Vector3() {}
 
-	Vector3(const Vector3& v) : x(v.x), y(v.y), z(v.z) {}
+#if defined(RT_SSE_VECTOR3)
+	explicit Vector3(__m128 m) { store(m); }
 
+	Vector3(float nx, float ny, float nz) : x(nx), y(ny), z(nz), w(0.f) {}
+
+	Vector3(float f) : x(f), y(f), z(f), w(f) {}
+
+	inline __m128 load() const { return _mm_load_ps(&x); }
+	inline void store(__m128 m) { _mm_store_ps(&x, m); }
+#else
 	Vector3(float nx, float ny, float nz) : x(nx), y(ny), z(nz) {}
 
 	Vector3(float f) : x(f), y(f), z(f) {}
-
-	// Assignment
-	Vector3 &operator =(const Vector3 &v) {
-		x = v.x; y = v.y; z = v.z;
-		return *this;
-	}
+#endif
 
 	bool operator ==(const Vector3& v) const {
 		return x == v.x && y == v.y && z == v.z;
@@ -35,16 +60,18 @@ public:
 		return x != v.x || y != v.y || z != v.z;
 	}
 
+	// Component access by axis index (0 = x, 1 = y, 2 = z)
+	inline float operator [](int axis) const {
+		return axis == 0 ? x : (axis == 1 ? y : z);
+	}
+
 	// Geometric
 	void normalize()
 	{
 		float magSqrd = magnitudeSquared();
 		if (magSqrd > 0.0f)
 		{
-			float oneOverMag = 1.f / sqrt(magSqrd);
-			x *= oneOverMag;
-			y *= oneOverMag;
-			z *= oneOverMag;
+			*this *= 1.f / sqrtf(magSqrd);
 		}
 	}
 
@@ -59,17 +86,29 @@ public:
 		return Vector3(*this).normalized();
 	}
 
-	float dot(const Vector3& v) const
+	// Summed x, y then z like the scalar code, rather than with a horizontal add
+	float dot(const Vector3& o) const
+	{
+#if defined(RT_SSE_VECTOR3)
+		__m128 p = _mm_mul_ps(load(), o.load());
+		__m128 sum = _mm_add_ss(_mm_add_ss(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1))), _mm_movehl_ps(p, p));
+		return _mm_cvtss_f32(sum);
+#else
+		return x * o.x + y * o.y + z * o.z;
+#endif
+	}
+
+	inline Vector3 cross(const Vector3& o) const
 	{
-		return x * v.x + y * v.y + z * v.z;
+		return Vector3(y * o.z - z * o.y, z * o.x - x * o.z, x * o.y - y * o.x);
 	}
 
-	inline float magnitudeSquared()
+	inline float magnitudeSquared() const
 	{
-		return x * x + y * y + z * z;
+		return dot(*this);
 	}
 
-	inline float magnitude()
+	inline float magnitude() const
 	{
 		return sqrtf(magnitudeSquared());
 	}
@@ -77,15 +116,17 @@ public:
 	// Math
 	inline Vector3 & reset()
 	{
-		x = y = z = 0.f;
+		*this = Vector3(0.f);
 		return *this;
 	}
 
 	static inline Vector3 zero()
 	{
-		return Vector3().reset();
+		return Vector3(0.f);
 	}
 
+	// a at t = 0, b at t = 1
+	static inline Vector3 lerp(const Vector3& a, const Vector3& b, float t);
 
 	// Note: *this is pointing away from angle of incidence
 	//Vector3 reflect(const Vector3& v) const
@@ -94,11 +135,60 @@ public:
 	//}
 
 	// Note: *this is pointing towards angle of incidence
-	inline Vector3 reflect(const Vector3& v) const
+	inline Vector3 reflect(const Vector3& n) const
 	{
-		return *this - (v * 2.f * v.dot(*this));
+		return *this - (n * 2.f * n.dot(*this));
 	}
 
+#if defined(RT_SSE_VECTOR3)
+	inline Vector3 operator -() const
+	{
+		return Vector3(_mm_xor_ps(load(), _mm_set1_ps(-0.f)));
+	}
+
+	inline Vector3 operator +(const Vector3& o) const
+	{
+		return Vector3(_mm_add_ps(o.load(), load()));
+	}
+
+	inline Vector3 operator -(const Vector3& o) const
+	{
+		return Vector3(_mm_sub_ps(load(), o.load()));
+	}
+
+	inline Vector3 operator *(float s) const
+	{
+		return Vector3(_mm_mul_ps(load(), _mm_set1_ps(s)));
+	}
+
+	inline Vector3 operator *(const Vector3& o) const
+	{
+		return Vector3(_mm_mul_ps(o.load(), load()));
+	}
+
+	inline Vector3 operator /(float d) const
+	{
+		return *this * (1.f / d);
+	}
+
+	inline Vector3 &operator +=(const Vector3& o)
+	{
+		store(_mm_add_ps(load(), o.load()));
+		return *this;
+	}
+
+	inline Vector3 &operator -=(const Vector3& o)
+	{
+		store(_mm_sub_ps(load(), o.load()));
+		return *this;
+	}
+
+	inline Vector3 &operator *=(float s)
+	{
+		store(_mm_mul_ps(load(), _mm_set1_ps(s)));
+		return *this;
+	}
+#else
 	inline Vector3 operator -() const
 	{
 		return Vector3(-x, -y, -z);
@@ -125,7 +215,7 @@ public:
 	}
 
 	inline Vector3 operator /(float d) const
-	{	
+	{
 		float oneOver = 1.f / d;
 		return Vector3(x * oneOver, y * oneOver, z * oneOver);
 	}
@@ -147,23 +237,29 @@ public:
 		x *= s; y *= s; z *= s;
 		return *this;
 	}
+#endif
 
 	inline Vector3 &operator /=(float d)
 	{
-		float oneOver = 1.f / d;
-		x *= oneOver; y *= oneOver; z *= oneOver;
-		return *this;
+		return *this *= 1.f / d;
 	}
-
-	~Vector3() {}
 };
 
+#if defined(RT_SSE_VECTOR3)
+static_assert(sizeof(Vector3) == 16, "Vector3 has to load as one __m128");
+#endif
+
 inline Vector3 operator *(float t, const Vector3& rhs)
 {
-	return Vector3(t * rhs.x, t * rhs.y, t * rhs.z);
+	return rhs * t;
 }
 
 inline Vector3 operator /(float t, const Vector3& rhs)
 {
 	return Vector3(t / rhs.x, t / rhs.y, t / rhs.z);
 }
+
+inline Vector3 Vector3::lerp(const Vector3& a, const Vector3& b, float t)
+{
+	return (1.f - t) * a + t * b;
+}
@@ -0,0 +1,273 @@
+#pragma once
+
+#include "simd.h"
+#include "vector3.h"
+
+/////////////////////////////////////////////////////////////////
+//
+// Vectors of 4 or 8 lanes for running the same math on several
+// rays at once.
+//
+// Float4 / Float8 - 4 or 8 floats with the usual arithmetic.
+// Comparisons give a mask that select() uses to pick per lane.
+// Without AVX a Float8 is two Float4s.
+//
+// Vector3x4 / Vector3x8 - 4 or 8 Vector3s as structure of arrays,
+// with the operations of Vector3 (dot, reflect, normalize, lerp...)
+// taking and returning one value per lane. Written against these
+// and Vector3, a function can be a template that runs one ray or
+// N rays wide. Each lane rounds exactly like Vector3 does.
+//
+/////////////////////////////////////////////////////////////////
+
+#if defined(RT_SSE)
+
+class Float4
+{
+public:
+
+	static const int Width = 4;
+
+	__m128 v;
+
+	Float4() {}
+	Float4(float f) : v(_mm_set1_ps(f)) {}
+	explicit Float4(__m128 m) : v(m) {}
+
+	static inline Float4 load(const float* p) { return Float4(_mm_loadu_ps(p)); }
+	inline void store(float* p) const { _mm_storeu_ps(p, v); }
+
+	inline float operator [](int lane) const
+	{
+		float lanes[Width];
+		store(lanes);
+		return lanes[lane];
+	}
+
+	// One bit per lane, set where the lane's mask is true
+	inline int mask() const { return _mm_movemask_ps(v); }
+
+	inline Float4 operator -() const { return Float4(_mm_xor_ps(v, _mm_set1_ps(-0.f))); }
+};
+
+inline Float4 operator +(const Float4& a, const Float4& b) { return Float4(_mm_add_ps(a.v, b.v)); }
+inline Float4 operator -(const Float4& a, const Float4& b) { return Float4(_mm_sub_ps(a.v, b.v)); }
+inline Float4 operator *(const Float4& a, const Float4& b) { return Float4(_mm_mul_ps(a.v, b.v)); }
+inline Float4 operator /(const Float4& a, const Float4& b) { return Float4(_mm_div_ps(a.v, b.v)); }
+inline Float4 operator <(const Float4& a, const Float4& b) { return Float4(_mm_cmplt_ps(a.v, b.v)); }
+inline Float4 operator >(const Float4& a, const Float4& b) { return Float4(_mm_cmpgt_ps(a.v, b.v)); }
+inline Float4 operator &(const Float4& a, const Float4& b) { return Float4(_mm_and_ps(a.v, b.v)); }
+inline Float4 operator |(const Float4& a, const Float4& b) { return Float4(_mm_or_ps(a.v, b.v)); }
+
+inline Float4 sqrt(const Float4& a) { return Float4(_mm_sqrt_ps(a.v)); }
+inline Float4 min(const Float4& a, const Float4& b) { return Float4(_mm_min_ps(a.v, b.v)); }
+inline Float4 max(const Float4& a, const Float4& b) { return Float4(_mm_max_ps(a.v, b.v)); }
+
+// a where mask is set, b elsewhere
+inline Float4 select(const Float4& mask, const Float4& a, const Float4& b)
+{
+	return Float4(_mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)));
+}
+
+#if defined(RT_AVX)
+
+class Float8
+{
+public:
+
+	static const int Width = 8;
+
+	__m256 v;
+
+	Float8() {}
+	Float8(float f) : v(_mm256_set1_ps(f)) {}
+	explicit Float8(__m256 m) : v(m) {}
+
+	static inline Float8 load(const float* p) { return Float8(_mm256_loadu_ps(p)); }
+	inline void store(float* p) const { _mm256_storeu_ps(p, v); }
+
+	inline float operator [](int lane) const
+	{
+		float lanes[Width];
+		store(lanes);
+		return lanes[lane];
+	}
+
+	inline int mask() const { return _mm256_movemask_ps(v); }
+
+	inline Float8 operator -() const { return Float8(_mm256_xor_ps(v, _mm256_set1_ps(-0.f))); }
+};
+
+inline Float8 operator +(const Float8& a, const Float8& b) { return Float8(_mm256_add_ps(a.v, b.v)); }
+inline Float8 operator -(const Float8& a, const Float8& b) { return Float8(_mm256_sub_ps(a.v, b.v)); }
+inline Float8 operator *(const Float8& a, const Float8& b) { return Float8(_mm256_mul_ps(a.v, b.v)); }
+inline Float8 operator /(const Float8& a, const Float8& b) { return Float8(_mm256_div_ps(a.v, b.v)); }
+inline Float8 operator <(const Float8& a, const Float8& b) { return Float8(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)); }
+inline Float8 operator >(const Float8& a, const Float8& b) { return Float8(_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)); }
+inline Float8 operator &(const Float8& a, const Float8& b) { return Float8(_mm256_and_ps(a.v, b.v)); }
+inline Float8 operator |(const Float8& a, const Float8& b) { return Float8(_mm256_or_ps(a.v, b.v)); }
+
+inline Float8 sqrt(const Float8& a) { return Float8(_mm256_sqrt_ps(a.v)); }
+inline Float8 min(const Float8& a, const Float8& b) { return Float8(_mm256_min_ps(a.v, b.v)); }
+inline Float8 max(const Float8& a, const Float8& b) { return Float8(_mm256_max_ps(a.v, b.v)); }
+
+inline Float8 select(const Float8& mask, const Float8& a, const Float8& b)
+{
+	return Float8(_mm256_blendv_ps(b.v, a.v, mask.v));
+}
+
+#else
+
+class Float8
+{
+public:
+
+	static const int Width = 8;
+
+	Float4 lo, hi;
+
+	Float8() {}
+	Float8(float f) : lo(f), hi(f) {}
+	Float8(const Float4& l, const Float4& h) : lo(l), hi(h) {}
+
+	static inline Float8 load(const float* p) { return Float8(Float4::load(p), Float4::load(p + 4)); }
+	inline void store(float* p) const { lo.store(p); hi.store(p + 4); }
+
+	inline float operator [](int lane) const { return lane < 4 ? lo[lane] : hi[lane - 4]; }
+
+	inline int mask() const { return lo.mask() | (hi.mask() << 4); }
+
+	inline Float8 operator -() const { return Float8(-lo, -hi); }
+};
+
+inline Float8 operator +(const Float8& a, const Float8& b) { return Float8(a.lo + b.lo, a.hi + b.hi); }
+inline Float8 operator -(const Float8& a, const Float8& b) { return Float8(a.lo - b.lo, a.hi - b.hi); }
+inline Float8 operator *(const Float8& a, const Float8& b) { return Float8(a.lo * b.lo, a.hi * b.hi); }
+inline Float8 operator /(const Float8& a, const Float8& b) { return Float8(a.lo / b.lo, a.hi / b.hi); }
+inline Float8 operator <(const Float8& a, const Float8& b) { return Float8(a.lo < b.lo, a.hi < b.hi); }
+inline Float8 operator >(const Float8& a, const Float8& b) { return Float8(a.lo > b.lo, a.hi > b.hi); }
+inline Float8 operator &(const Float8& a, const Float8& b) { return Float8(a.lo & b.lo, a.hi & b.hi); }
+inline Float8 operator |(const Float8& a, const Float8& b) { return Float8(a.lo | b.lo, a.hi | b.hi); }
+
+inline Float8 sqrt(const Float8& a) { return Float8(sqrt(a.lo), sqrt(a.hi)); }
+inline Float8 min(const Float8& a, const Float8& b) { return Float8(min(a.lo, b.lo), min(a.hi, b.hi)); }
+inline Float8 max(const Float8& a, const Float8& b) { return Float8(max(a.lo, b.lo), max(a.hi, b.hi)); }
+
+inline Float8 select(const Float8& mask, const Float8& a, const Float8& b)
+{
+	return Float8(select(mask.lo, a.lo, b.lo), select(mask.hi, a.hi, b.hi));
+}
+
+#endif
+
+template <class F>
+class Vector3Wide
+{
+public:
+
+	static const int Width = F::Width;
+
+	F x, y, z;
+
+	Vector3Wide() {}
+	Vector3Wide(const F& nx, const F& ny, const F& nz) : x(nx), y(ny), z(nz) {}
+
+	// The same vector in every lane
+	Vector3Wide(const Vector3& v) : x(v.x), y(v.y), z(v.z) {}
+
+	// Lanes from Width consecutive entries of each array
+	static inline Vector3Wide load(const float* xs, const float* ys, const float* zs)
+	{
+		return Vector3Wide(F::load(xs), F::load(ys), F::load(zs));
+	}
+
+	inline void store(float* xs, float* ys, float* zs) const
+	{
+		x.store(xs);
+		y.store(ys);
+		z.store(zs);
+	}
+
+	inline Vector3 operator [](int lane) const
+	{
+		return Vector3(x[lane], y[lane], z[lane]);
+	}
+
+	// Geometric
+	inline F dot(const Vector3Wide& v) const
+	{
+		return x * v.x + y * v.y + z * v.z;
+	}
+
+	inline F magnitudeSquared() const
+	{
+		return dot(*this);
+	}
+
+	inline F magnitude() const
+	{
+		return sqrt(magnitudeSquared());
+	}
+
+	// Lanes of length 0 are left alone, as in Vector3
+	void normalize()
+	{
+		F magSqrd = magnitudeSquared();
+		F scale = ::select(magSqrd > F(0.f), F(1.f) / sqrt(magSqrd), F(1.f));
+		x = x * scale;
+		y = y * scale;
+		z = z * scale;
+	}
+
+	Vector3Wide normalized() const
+	{
+		Vector3Wide v(*this);
+		v.normalize();
+		return v;
+	}
+
+	// Note: *this is pointing towards angle of incidence
+	inline Vector3Wide reflect(const Vector3Wide& n) const
+	{
+		return *this - (n * F(2.f) * n.dot(*this));
+	}
+
+	static inline Vector3Wide lerp(const Vector3Wide& a, const Vector3Wide& b, const F& t)
+	{
+		return (F(1.f) - t) * a + t * b;
+	}
+
+	// Per lane a where mask is set, b elsewhere
+	static inline Vector3Wide select(const F& mask, const Vector3Wide& a, const Vector3Wide& b)
+	{
+		return Vector3Wide(::select(mask, a.x, b.x), ::select(mask, a.y, b.y), ::select(mask, a.z, b.z));
+	}
+
+	// Math
+	inline Vector3Wide operator -() const { return Vector3Wide(-x, -y, -z); }
+	inline Vector3Wide operator +(const Vector3Wide& v) const { return Vector3Wide(v.x + x, v.y + y, v.z + z); }
+	inline Vector3Wide operator -(const Vector3Wide& v) const { return Vector3Wide(x - v.x, y - v.y, z - v.z); }
+	inline Vector3Wide operator *(const F& s) const { return Vector3Wide(x * s, y * s, z * s); }
+	inline Vector3Wide operator *(const Vector3Wide& v) const { return Vector3Wide(v.x * x, v.y * y, v.z * z); }
+
+	inline Vector3Wide operator /(const F& d) const
+	{
+		F oneOver = F(1.f) / d;
+		return Vector3Wide(x * oneOver, y * oneOver, z * oneOver);
+	}
+
+	inline Vector3Wide &operator +=(const Vector3Wide& v) { return *this = *this + v; }
+	inline Vector3Wide &operator -=(const Vector3Wide& v) { return *this = *this - v; }
+	inline Vector3Wide &operator *=(const F& s) { return *this = *this * s; }
+};
+
+template <class F>
+inline Vector3Wide<F> operator *(const F& t, const Vector3Wide<F>& rhs)
+{
+	return rhs * t;
+}
+
+typedef Vector3Wide<Float4> Vector3x4;
+typedef Vector3Wide<Float8> Vector3x8;
+
+#endif
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <limits>
+#include <memory>
+#include <vector>
+#include "config.h"
+#include "material.h"
+#include "surface.h"
+#include "utils.h"
+
+/////////////////////////////////////////////////////////////////
+//
+// class Wavefront - traces a batch of paths one stage at a time.
+//
+// Instead of following each path to its end like color() in
+// main.cpp, every path of the batch is taken one bounce further per
+// round:
+//
+//   generate  - a camera ray for every requested sample
+//   intersect - closest hit for every live path. Misses go to the
+//               escape queue, hits to the queue of their material type
+//   escape    - the sky, weighted by the path throughput
+//   shade     - one loop per material type, with the type known at
+//               compile time so scatter doesn't switch on it. Paths
+//               that carry on are compacted into the next round.
+//
+// Every stage is a plain loop over a compact array doing the same
+// work for every element. Sample values are addressed exactly as in
+// color(), so both give the same image.
+//
+/////////////////////////////////////////////////////////////////
+
+// The samples to take for one pixel
+struct PixelSamples
+{
+	int x, y;
+	int firstSample;
+	int count;
+};
+
+class Wavefront
+{
+public:
+
+	Wavefront(const Surface& world, const MaterialTable& materials, const Config& c) : world(world), materials(materials), config(c), sampler(Sampler::create(c.sampler, c.seed, c.ns)) {}
+
+	// Traces every requested sample. radiance gets one value per sample, ordered by pixel then sample.
+	void trace(const std::vector<PixelSamples>& pixels, std::vector<Vector3>& radiance)
+	{
+		generate(pixels);
+		radiance.assign(paths.size(), Vector3(0.f));
+
+		for (int depth = 0; !paths.empty(); depth++)
+		{
+			intersect();
+			escape(radiance);
+
+			nextPaths.clear();
+			if (depth < config.maxDepth)
+			{
+				shade<MaterialLambertian>(shadeQueues[MaterialLambertian], depth);
+				shade<MaterialMetal>(shadeQueues[MaterialMetal], depth);
+			}
+
+			paths.swap(nextPaths);
+		}
+	}
+
+private:
+
+	struct PathState
+	{
+		Ray ray;
+		Vector3 throughput;
+		int x, y;
+		int sample;
+		int result;		// index into radiance
+	};
+
+	void generate(const std::vector<PixelSamples>& pixels)
+	{
+		paths.clear();
+		for (size_t p = 0; p < pixels.size(); p++)
+		{
+			const PixelSamples& pixel = pixels[p];
+			for (int s = pixel.firstSample; s < pixel.firstSample + pixel.count; s++)
+			{
+				sampler->startPixelSample(pixel.x, pixel.y, s);
+				float u = (float(pixel.x) + Utils::rand_n(*sampler)) / float(config.nx);
+				float v = (float(pixel.y) + Utils::rand_n(*sampler)) / float(config.ny);
+
+				PathState path = { Ray(config.origin, config.lowerLeft + u * config.horizontal + v * config.vertical), Vector3(1.f), pixel.x, pixel.y, s, int(paths.size()) };
+				paths.push_back(path);
+			}
+		}
+	}
+
+	void intersect()
+	{
+		escaped.clear();
+		for (int m = 0; m < MaterialTypeCount; m++)
+		{
+			shadeQueues[m].clear();
+		}
+
+		hits.resize(paths.size());
+		for (size_t i = 0; i < paths.size(); i++)
+		{
+			if (world.hit(paths[i].ray, 0.001, std::numeric_limits < float >::max(), hits[i]))
+			{
+				shadeQueues[materials.type(hits[i].mat)].push_back(int(i));
+			}
+			else
+			{
+				escaped.push_back(int(i));
+			}
+		}
+	}
+
+	void escape(std::vector<Vector3>& radiance)
+	{
+		for (size_t q = 0; q < escaped.size(); q++)
+		{
+			const PathState& path = paths[escaped[q]];
+			radiance[path.result] = path.throughput * Utils::skyColor(path.ray.direction());
+		}
+	}
+
+	template <MaterialType T>
+	void shade(const std::vector<int>& queue, int depth)
+	{
+		for (size_t q = 0; q < queue.size(); q++)
+		{
+			const PathState& path = paths[queue[q]];
+			const hit_record& rec = hits[queue[q]];
+
+			sampler->startPixelSample(path.x, path.y, path.sample);
+			sampler->startBounce(depth + 1);
+
+			Ray scattered;
+			Vector3 attenuation;
+			if (!MaterialTable::scatter<T>(materials[rec.mat], path.ray, rec, attenuation, scattered, *sampler))
+			{
+				continue;
+			}
+
+			Vector3 throughput = path.throughput * attenuation;
+			if (depth + 1 >= config.rrStartDepth && !Utils::russianRoulette(throughput, *sampler))
+			{
+				continue;
+			}
+
+			PathState next = { scattered, throughput, path.x, path.y, path.sample, path.result };
+			nextPaths.push_back(next);
+		}
+	}
+
+	const Surface& world;
+	const MaterialTable& materials;
+	const Config& config;
+	std::unique_ptr<Sampler> sampler;
+
+	std::vector<PathState> paths;
+	std::vector<PathState> nextPaths;
+	std::vector<hit_record> hits;
+	std::vector<int> escaped;
+	std::vector<int> shadeQueues[MaterialTypeCount];
+};